@@ -0,0 +1,242 @@
+/* payload.h
+ *
+ * Allocation of task payloads in the payload arena, shared by the
+ * pg_pandas functions and the pg_pandas background worker.
+ *
+ * The arena is a buddy allocator: a free chunk of order k is split in
+ * halves until one has the order requested, and a freed chunk is merged
+ * with its buddy for as long as the buddy is free too.  Chunks never merge
+ * beyond PANDAS_CHUNK_MAX, so the arena is a row of independent blocks of
+ * that size.  Free chunks are kept on a doubly linked list per order,
+ * linked through their first bytes.
+ */
+
+#ifndef PG_PANDAS_PAYLOAD_H
+#define PG_PANDAS_PAYLOAD_H
+
+#include "miscadmin.h"
+#include "storage/fd.h"
+
+#include <unistd.h>
+
+#include "shared_memory.h"
+
+/* Links of a free chunk */
+typedef struct {
+    int64 next;
+    int64 prev;
+} PandasFreeChunk;
+
+#define ARENA_MAP(shared) ((uint8 *) (shared) + MAXALIGN(sizeof(PandasSharedData)))
+#define ARENA_CHUNKS(shared) ((char *) ARENA_MAP(shared) + (shared)->arena_size / PANDAS_CHUNK_MIN)
+#define ARENA_CHUNK(shared, chunk) ((PandasFreeChunk *) (ARENA_CHUNKS(shared) + (chunk)))
+
+/* Smallest order whose chunks hold size bytes */
+static inline int
+payload_order(Size size)
+{
+    int order = 0;
+
+    while (((Size) PANDAS_CHUNK_MIN << order) < size)
+        order++;
+    return order;
+}
+
+/* Put a chunk on the free list of its order; arena_lock held */
+static inline void
+arena_push(PandasSharedData *shared, int64 chunk, int order)
+{
+    PandasFreeChunk *entry = ARENA_CHUNK(shared, chunk);
+
+    entry->prev = -1;
+    entry->next = shared->arena_free[order];
+    if (entry->next >= 0)
+        ARENA_CHUNK(shared, entry->next)->prev = chunk;
+    shared->arena_free[order] = chunk;
+    ARENA_MAP(shared)[chunk / PANDAS_CHUNK_MIN] = order + 1;
+}
+
+/* Take a chunk off the free list of its order; arena_lock held */
+static inline void
+arena_unlink(PandasSharedData *shared, int64 chunk, int order)
+{
+    PandasFreeChunk *entry = ARENA_CHUNK(shared, chunk);
+
+    if (entry->prev >= 0)
+        ARENA_CHUNK(shared, entry->prev)->next = entry->next;
+    else
+        shared->arena_free[order] = entry->next;
+    if (entry->next >= 0)
+        ARENA_CHUNK(shared, entry->next)->prev = entry->prev;
+    ARENA_MAP(shared)[chunk / PANDAS_CHUNK_MIN] = 0;
+}
+
+/* Set up an empty arena of arena_size bytes; called once at startup */
+static inline void
+arena_init(PandasSharedData *shared, Size arena_size)
+{
+    SpinLockInit(&shared->arena_lock);
+    shared->arena_size = arena_size;
+    for (int order = 0; order < PANDAS_CHUNK_ORDERS; order++)
+        shared->arena_free[order] = -1;
+    memset(ARENA_MAP(shared), 0, arena_size / PANDAS_CHUNK_MIN);
+    for (Size chunk = 0; chunk < arena_size; chunk += PANDAS_CHUNK_MAX)
+        arena_push(shared, chunk, PANDAS_CHUNK_ORDERS - 1);
+}
+
+/* Allocate a chunk of the given order, or return -1 if the arena is full */
+static inline int64
+arena_alloc(PandasSharedData *shared, int order)
+{
+    int64 chunk;
+    int k = order;
+
+    SpinLockAcquire(&shared->arena_lock);
+    while (k < PANDAS_CHUNK_ORDERS && shared->arena_free[k] < 0)
+        k++;
+    if (k == PANDAS_CHUNK_ORDERS)
+    {
+        SpinLockRelease(&shared->arena_lock);
+        return -1;
+    }
+
+    chunk = shared->arena_free[k];
+    arena_unlink(shared, chunk, k);
+    while (k > order)
+    {
+        k--;
+        arena_push(shared, chunk + ((int64) PANDAS_CHUNK_MIN << k), k);
+    }
+    SpinLockRelease(&shared->arena_lock);
+
+    return chunk;
+}
+
+/* Return a chunk to the arena, merging it with free buddies */
+static inline void
+arena_release(PandasSharedData *shared, int64 chunk, int order)
+{
+    SpinLockAcquire(&shared->arena_lock);
+    while (order < PANDAS_CHUNK_ORDERS - 1)
+    {
+        int64 buddy = chunk ^ ((int64) PANDAS_CHUNK_MIN << order);
+
+        if (ARENA_MAP(shared)[buddy / PANDAS_CHUNK_MIN] != order + 1)
+            break;
+        arena_unlink(shared, buddy, order);
+        chunk = Min(chunk, buddy);
+        order++;
+    }
+    arena_push(shared, chunk, order);
+    SpinLockRelease(&shared->arena_lock);
+}
+
+/*
+ * Copy len bytes into a new payload, NUL-terminated.  Returns false if
+ * neither the arena nor a new DSM segment can hold it.
+ */
+static inline bool
+payload_store(PandasSharedData *shared, PandasPayload *payload, const char *src, Size len)
+{
+    int order = payload_order(len + 1);
+    int64 chunk = -1;
+    char *dest;
+
+    memset(payload, 0, sizeof(PandasPayload));
+    if (len == 0)
+        return true;
+
+    if (order < PANDAS_CHUNK_ORDERS)
+        chunk = arena_alloc(shared, order);
+
+    if (chunk >= 0)
+    {
+        dest = ARENA_CHUNKS(shared) + chunk;
+        memcpy(dest, src, len);
+        dest[len] = '\0';
+        payload->kind = PANDAS_PAYLOAD_ARENA;
+        payload->chunk = chunk;
+    }
+    else
+    {
+        dsm_segment *seg = dsm_create(len + 1, DSM_CREATE_NULL_IF_MAXSEGMENTS);
+
+        if (seg == NULL)
+            return false;
+        dest = dsm_segment_address(seg);
+        memcpy(dest, src, len);
+        dest[len] = '\0';
+
+        /* Keep the segment alive until the payload is freed */
+        dsm_pin_segment(seg);
+        payload->kind = PANDAS_PAYLOAD_DSM;
+        payload->handle = dsm_segment_handle(seg);
+        dsm_detach(seg);
+    }
+    payload->len = len;
+
+    return true;
+}
+
+/*
+ * Path of a spilled payload, relative to the data directory.  The
+ * PG_TEMP_FILE_PREFIX prefix lets the server remove files left behind by
+ * a crash at the next start.
+ */
+static inline void
+payload_file_path(const PandasPayload *payload, char *path)
+{
+    char dir[MAXPGPATH];
+
+    TempTablespacePath(dir, payload->tablespace);
+    snprintf(path, MAXPGPATH, "%s/%s_pg_pandas.%llu", dir, PG_TEMP_FILE_PREFIX,
+             (unsigned long long) payload->file);
+}
+
+/*
+ * NUL-terminated contents of a payload held in shared memory; spilled and
+ * memfd payloads read as empty.  *seg is set to the segment mapped to read it, if any,
+ * which the caller detaches when done.
+ */
+static inline const char *
+payload_data(PandasSharedData *shared, const PandasPayload *payload, dsm_segment **seg)
+{
+    *seg = NULL;
+    if (payload->kind == PANDAS_PAYLOAD_ARENA)
+        return ARENA_CHUNKS(shared) + payload->chunk;
+    if (payload->kind == PANDAS_PAYLOAD_DSM)
+        *seg = dsm_attach(payload->handle);
+    return *seg != NULL ? (const char *) dsm_segment_address(*seg) : "";
+}
+
+/* Release the memory of a payload and leave it empty */
+static inline void
+payload_free(PandasSharedData *shared, PandasPayload *payload)
+{
+    if (payload->kind == PANDAS_PAYLOAD_ARENA)
+        arena_release(shared, payload->chunk, payload_order(payload->len + 1));
+    else if (payload->kind == PANDAS_PAYLOAD_DSM)
+        dsm_unpin_segment(payload->handle);
+    else if (payload->kind == PANDAS_PAYLOAD_FILE)
+    {
+        char path[MAXPGPATH];
+
+        payload_file_path(payload, path);
+        (void) PathNameDeleteTemporaryFile(path, false);
+    }
+    else if (payload->kind == PANDAS_PAYLOAD_MEMFD && payload->pid == MyProcPid)
+        close(payload->fd);
+    memset(payload, 0, sizeof(PandasPayload));
+}
+
+/* Release a task's payloads and mark its slot free; lock held */
+static inline void
+free_task(PandasSharedData *shared, PandasTask *task)
+{
+    payload_free(shared, &task->data);
+    payload_free(shared, &task->operation);
+    payload_free(shared, &task->result);
+    task->state = PANDAS_TASK_FREE;
+}
+
+#endif /* PG_PANDAS_PAYLOAD_H */
@@ -0,0 +1,272 @@
+-- pg_pandas--1.0--1.1.sql
+
+-- pandas() takes an optional priority; the two-argument form is replaced
+-- rather than overloaded, which would make two-argument calls ambiguous
+DROP FUNCTION pandas(anyelement, text);
+
+CREATE FUNCTION pandas(data anyelement, operation text, priority int DEFAULT NULL)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'pg_pandas_fn'
+LANGUAGE C VOLATILE;
+
+-- Cache a table as a named DataFrame in the worker, optionally kept fresh
+-- from a logical replication slot (test_decoding, or pgoutput with a publication)
+CREATE FUNCTION pandas_cache_table(name text, source regclass, key_column text,
+                                   slot_name name DEFAULT NULL,
+                                   publication name DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_pandas_cache_table'
+LANGUAGE C VOLATILE;
+
+-- Drop a cached DataFrame
+CREATE FUNCTION pandas_cache_drop(name text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_pandas_cache_drop'
+LANGUAGE C VOLATILE STRICT;
+
+-- Cached frames are readable by every session, so loading and dropping
+-- them is left to roles the administrator grants it to
+REVOKE EXECUTE ON FUNCTION pandas_cache_table(text, regclass, text, name, name) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION pandas_cache_drop(text) FROM PUBLIC;
+
+-- Run one operation over several workers: the input (a JSON array of
+-- records) is hash-partitioned by key_column into shards, the results are
+-- concatenated and optionally passed through reduce
+CREATE FUNCTION pandas_partitioned(data text, operation text, key_column text,
+                                   shards int DEFAULT NULL, reduce text DEFAULT NULL)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'pg_pandas_partitioned_fn'
+LANGUAGE C VOLATILE;
+
+-- Apply a row-local operation to the rows of query in batches of
+-- batch_size rows (default pg_pandas.batch_size); returns each batch's
+-- result (JSON) as one row.  Called in the select list it streams, while
+-- in FROM the rows are materialized first.
+CREATE FUNCTION pandas_map_batches(query text, operation text, batch_size int DEFAULT NULL)
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'pg_pandas_map_batches_fn'
+LANGUAGE C VOLATILE;
+
+-- Number of pandas() calls waiting for a worker, for load shedding
+CREATE FUNCTION pandas_queue_depth()
+RETURNS integer
+AS 'MODULE_PATHNAME', 'pg_pandas_queue_depth'
+LANGUAGE C VOLATILE;
+
+-- Incrementally maintained pandas materialized views
+--
+-- Changes to the source table are captured by statement triggers into
+-- pandas_matview_log.  A refresh consumes only those rows: with the
+-- 'additive' strategy the operation is applied to the inserted and the
+-- deleted rows and the difference is added to the stored result per key;
+-- with 'recompute' the whole result is rebuilt when anything changed.  A
+-- TRUNCATE of the source always rebuilds the result.
+CREATE TABLE pandas_matview (
+    name text PRIMARY KEY,
+    source regclass NOT NULL,
+    operation text NOT NULL,
+    key_columns text[] NOT NULL,
+    strategy text NOT NULL CHECK (strategy IN ('additive', 'recompute')),
+    last_refresh timestamptz
+);
+
+CREATE TABLE pandas_matview_log (
+    id bigserial PRIMARY KEY,
+    view_name text NOT NULL REFERENCES pandas_matview (name) ON DELETE CASCADE,
+    sign int NOT NULL,          -- 1 inserted, -1 deleted, 0 truncated
+    change jsonb NOT NULL
+);
+
+-- For additive views, value also holds the number of source rows of the
+-- key as __pg_pandas_rows; the group is removed when it drops to zero
+CREATE TABLE pandas_matview_rows (
+    view_name text NOT NULL REFERENCES pandas_matview (name) ON DELETE CASCADE,
+    key jsonb NOT NULL,
+    value jsonb NOT NULL,
+    PRIMARY KEY (view_name, key)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('pandas_matview', '');
+SELECT pg_catalog.pg_extension_config_dump('pandas_matview_log', '');
+SELECT pg_catalog.pg_extension_config_dump('pandas_matview_log_id_seq', '');
+SELECT pg_catalog.pg_extension_config_dump('pandas_matview_rows', '');
+
+-- Add the numeric fields of b to those of a
+CREATE FUNCTION pandas_jsonb_add(a jsonb, b jsonb)
+RETURNS jsonb
+AS $$
+    SELECT jsonb_object_agg(k, CASE WHEN jsonb_typeof(a -> k) = 'number' AND jsonb_typeof(b -> k) = 'number'
+                                    THEN to_jsonb((a ->> k)::numeric + (b ->> k)::numeric)
+                                    ELSE coalesce(b -> k, a -> k) END)
+    FROM jsonb_object_keys(a || b) AS k
+$$ LANGUAGE sql IMMUTABLE STRICT;
+
+CREATE FUNCTION pandas_matview_capture()
+RETURNS trigger
+AS $$
+BEGIN
+    IF TG_OP = 'TRUNCATE' THEN
+        INSERT INTO pandas_matview_log (view_name, sign, change) VALUES (TG_ARGV[0], 0, '{}');
+        RETURN NULL;
+    END IF;
+    IF TG_OP IN ('UPDATE', 'DELETE') THEN
+        INSERT INTO pandas_matview_log (view_name, sign, change)
+        SELECT TG_ARGV[0], -1, to_jsonb(o) FROM pandas_old_rows o;
+    END IF;
+    IF TG_OP IN ('INSERT', 'UPDATE') THEN
+        INSERT INTO pandas_matview_log (view_name, sign, change)
+        SELECT TG_ARGV[0], 1, to_jsonb(n) FROM pandas_new_rows n;
+    END IF;
+    RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Split a JSON result of the operation into stored (key, value) rows
+CREATE FUNCTION pandas_matview_split(mv pandas_matview, result text)
+RETURNS TABLE (key jsonb, value jsonb)
+AS $$
+    SELECT (SELECT jsonb_object_agg(k, rec -> k) FROM unnest(mv.key_columns) AS k),
+           rec - mv.key_columns
+    FROM jsonb_array_elements(result::jsonb) AS rec
+$$ LANGUAGE sql STABLE;
+
+-- Rebuild the stored result of a view from its whole source
+CREATE FUNCTION pandas_matview_recompute(mv pandas_matview)
+RETURNS void
+AS $$
+DECLARE
+    data text;
+    operation text := mv.operation;
+    result text;
+BEGIN
+    DELETE FROM pandas_matview_rows WHERE view_name = mv.name;
+
+    EXECUTE format('SELECT jsonb_agg(to_jsonb(s))::text FROM %s s', mv.source)
+        INTO data;
+    IF data IS NULL THEN
+        RETURN;
+    END IF;
+    IF mv.strategy = 'additive' THEN
+        operation := format('lambda df: _pg_pandas_additive_rows(%s, df, %s)',
+                            mv.operation, to_jsonb(mv.key_columns));
+    END IF;
+    SELECT r INTO result FROM pandas(data, operation) AS t(r text);
+
+    INSERT INTO pandas_matview_rows (view_name, key, value)
+    SELECT mv.name, s.key, s.value FROM pandas_matview_split(mv, result) s;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Define a pandas materialized view and compute it once
+CREATE FUNCTION pandas_create_matview(name text, source regclass, operation text,
+                                      key_columns text[], strategy text DEFAULT 'additive')
+RETURNS void
+AS $$
+DECLARE
+    mv pandas_matview;
+    trigger_name text := 'pandas_matview_' || left(md5(name), 16);
+BEGIN
+    -- Rows are counted per key in the source, so the keys must be its columns
+    IF strategy = 'additive' AND EXISTS (
+        SELECT 1 FROM unnest(key_columns) AS k
+        WHERE NOT EXISTS (SELECT 1 FROM pg_attribute a
+                          WHERE a.attrelid = source AND a.attname = k
+                            AND a.attnum > 0 AND NOT a.attisdropped)) THEN
+        RAISE EXCEPTION 'key columns of an additive pandas materialized view must be columns of %', source;
+    END IF;
+
+    INSERT INTO pandas_matview (name, source, operation, key_columns, strategy, last_refresh)
+    VALUES (name, source, operation, key_columns, strategy, now())
+    RETURNING * INTO mv;
+
+    EXECUTE format('CREATE TRIGGER %I AFTER INSERT ON %s REFERENCING NEW TABLE AS pandas_new_rows '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION pandas_matview_capture(%L)',
+                   trigger_name || '_ins', source, name);
+    EXECUTE format('CREATE TRIGGER %I AFTER UPDATE ON %s REFERENCING OLD TABLE AS pandas_old_rows '
+                   'NEW TABLE AS pandas_new_rows FOR EACH STATEMENT EXECUTE FUNCTION pandas_matview_capture(%L)',
+                   trigger_name || '_upd', source, name);
+    EXECUTE format('CREATE TRIGGER %I AFTER DELETE ON %s REFERENCING OLD TABLE AS pandas_old_rows '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION pandas_matview_capture(%L)',
+                   trigger_name || '_del', source, name);
+    EXECUTE format('CREATE TRIGGER %I AFTER TRUNCATE ON %s '
+                   'FOR EACH STATEMENT EXECUTE FUNCTION pandas_matview_capture(%L)',
+                   trigger_name || '_trunc', source, name);
+
+    PERFORM pandas_matview_recompute(mv);
+END;
+$$ LANGUAGE plpgsql;
+
+-- Apply the changes logged since the last refresh; returns how many were applied
+CREATE FUNCTION pandas_refresh_matview(view_name text)
+RETURNS bigint
+AS $$
+DECLARE
+    mv pandas_matview;
+    changes text;
+    consumed bigint;
+    truncated boolean;
+    delta text;
+BEGIN
+    SELECT * INTO mv FROM pandas_matview m WHERE m.name = view_name FOR UPDATE;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'pandas materialized view "%" does not exist', view_name;
+    END IF;
+
+    WITH taken AS (
+        DELETE FROM pandas_matview_log l WHERE l.view_name = mv.name RETURNING l.sign, l.change
+    )
+    SELECT count(*), jsonb_agg(change || jsonb_build_object('__pg_pandas_sign', sign))::text,
+           coalesce(bool_or(sign = 0), false)
+    INTO consumed, changes, truncated
+    FROM taken;
+
+    IF consumed > 0 THEN
+        IF mv.strategy = 'recompute' OR truncated THEN
+            PERFORM pandas_matview_recompute(mv);
+        ELSE
+            SELECT r INTO delta
+            FROM pandas(changes,
+                        format('lambda df: _pg_pandas_additive_delta(%s, df, %s)',
+                               mv.operation, to_jsonb(mv.key_columns))) AS t(r text);
+
+            INSERT INTO pandas_matview_rows AS m (view_name, key, value)
+            SELECT mv.name, s.key, s.value FROM pandas_matview_split(mv, delta) s
+            ON CONFLICT ON CONSTRAINT pandas_matview_rows_pkey
+            DO UPDATE SET value = pandas_jsonb_add(m.value, EXCLUDED.value);
+
+            -- Groups without source rows left are gone
+            DELETE FROM pandas_matview_rows m
+            WHERE m.view_name = mv.name AND (m.value ->> '__pg_pandas_rows')::numeric <= 0;
+        END IF;
+    END IF;
+
+    UPDATE pandas_matview m SET last_refresh = now() WHERE m.name = mv.name;
+    RETURN consumed;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Read the stored result of a view
+CREATE FUNCTION pandas_read_matview(view_name text)
+RETURNS SETOF jsonb
+AS $$
+    SELECT key || (value - '__pg_pandas_rows') FROM pandas_matview_rows m WHERE m.view_name = $1
+$$ LANGUAGE sql STABLE;
+
+-- Drop a view together with its change capture triggers
+CREATE FUNCTION pandas_drop_matview(view_name text)
+RETURNS void
+AS $$
+DECLARE
+    mv pandas_matview;
+    trigger_name text := 'pandas_matview_' || left(md5(view_name), 16);
+BEGIN
+    DELETE FROM pandas_matview m WHERE m.name = view_name RETURNING * INTO mv;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'pandas materialized view "%" does not exist', view_name;
+    END IF;
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', trigger_name || '_ins', mv.source);
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', trigger_name || '_upd', mv.source);
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', trigger_name || '_del', mv.source);
+    EXECUTE format('DROP TRIGGER IF EXISTS %I ON %s', trigger_name || '_trunc', mv.source);
+END;
+$$ LANGUAGE plpgsql;
@@ -7,72 +7,1658 @@
 #include "fmgr.h"
 #include "funcapi.h"
 #include "access/htup_details.h"
+#include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/pg_type.h"
+#include "commands/tablespace.h"
+#include "common/hashfn.h"
+#include "utils/acl.h"
 #include "utils/builtins.h"
 #include "executor/spi.h"
+#include "lib/stringinfo.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
 #include "storage/lwlock.h"
 #include "miscadmin.h"
 #include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rls.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
 
+#include "payload.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+PG_MODULE_MAGIC;
+
+static PandasSharedData *pandas_shared = NULL;
+int pg_pandas_parallel = 1;  /* Default value */
+int pg_pandas_cache_refresh_interval = 1000;  /* ms between slot polls */
+int pg_pandas_cache_persist_interval = 300000;  /* ms between cache writes */
+int pg_pandas_affinity_queue_limit = 2;  /* queued tasks before affinity is ignored */
+int pg_pandas_priority = 0;  /* scheduling priority of this session's tasks */
+int pg_pandas_weight = PANDAS_DEFAULT_WEIGHT;  /* fair share of this session's tenant */
+int pg_pandas_max_running_per_database = 0;  /* 0 means no cap */
+int pg_pandas_max_running_per_role = 0;
+int pg_pandas_max_queue_depth = 128;  /* queued tasks before calls are refused */
+int pg_pandas_queue_timeout = 0;  /* ms a call may wait for a worker, 0 = no limit */
+int pg_pandas_operation_timeout = 0;  /* ms an operation may run, 0 = no limit */
+int pg_pandas_inline_threshold = 0;  /* bytes below which calls run in the backend */
+int pg_pandas_batch_size = 10000;  /* rows per batch of pandas_map_batches() */
+char *pg_pandas_executor_socket = NULL;  /* executor pool to use instead of workers */
+char *pg_pandas_worker_cpus = NULL;  /* cpu list workers are pinned to */
+bool pg_pandas_numa_local = false;  /* pin to the NUMA node instead of one CPU */
+char *pg_pandas_databases = NULL;  /* databases with their own worker pool */
+int pg_pandas_payload_memory = 32;  /* MB of shared memory for task payloads */
+int pg_pandas_spill_threshold = 65536;  /* kB above which inputs go to a temp file, 0 = never */
+int pg_pandas_huge_page_threshold = 0;  /* kB above which inputs use huge pages, 0 = never */
+int pg_pandas_python_allocator = 0;  /* PYTHONMALLOC of the workers, see below */
+int pg_pandas_trim_threshold = 16384;  /* kB of payload after which workers trim malloc, 0 = never */
+int pg_pandas_max_requests_per_worker = 0;  /* tasks before a worker is replaced, 0 = never */
+int pg_pandas_max_worker_rss = 0;  /* MB of private memory before a worker is replaced, 0 = no limit */
+
+/* Values of pg_pandas.python_allocator; "default" leaves PYTHONMALLOC alone */
+static const struct config_enum_entry python_allocator_options[] = {
+    {"default", 0, false},
+    {"pymalloc", 1, false},
+    {"malloc", 2, false},
+    {"mimalloc", 3, false},
+    {NULL, 0, false}
+};
+
+/* CPUs representable in a worker's bgw_extra mask */
+#define PANDAS_MAX_CPUS (BGW_EXTRALEN * 8)
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+void _PG_init(void);
+Datum pg_pandas_fn(PG_FUNCTION_ARGS);
+Datum pg_pandas_cache_table(PG_FUNCTION_ARGS);
+Datum pg_pandas_cache_drop(PG_FUNCTION_ARGS);
+Datum pg_pandas_queue_depth(PG_FUNCTION_ARGS);
+Datum pg_pandas_partitioned_fn(PG_FUNCTION_ARGS);
+Datum pg_pandas_map_batches_fn(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(pg_pandas_fn);
+PG_FUNCTION_INFO_V1(pg_pandas_cache_table);
+PG_FUNCTION_INFO_V1(pg_pandas_cache_drop);
+PG_FUNCTION_INFO_V1(pg_pandas_queue_depth);
+PG_FUNCTION_INFO_V1(pg_pandas_partitioned_fn);
+PG_FUNCTION_INFO_V1(pg_pandas_map_batches_fn);
+
+/* Reserve room for the shared structure */
+static void
+pg_pandas_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+
+    RequestAddinShmemSpace(MAXALIGN(PANDAS_SHMEM_SIZE(pg_pandas_payload_memory)));
+}
+
+/* Allocate and initialize the shared structure */
+static void
+pg_pandas_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    pandas_shared = (PandasSharedData *) ShmemInitStruct("pg_pandas_shared",
+                                                         PANDAS_SHMEM_SIZE(pg_pandas_payload_memory),
+                                                         &found);
+
+    if (!found)
+    {
+        /* Initialize shared memory */
+        memset(pandas_shared, 0, sizeof(PandasSharedData));
+        LWLockInitialize(&pandas_shared->lock, LWLockNewTrancheId());
+        LWLockInitialize(&pandas_shared->frames_lock, LWLockNewTrancheId());
+        for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+            pandas_shared->workers[i].running = -1;
+        arena_init(pandas_shared, (Size) pg_pandas_payload_memory << 20);
+    }
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Parse a cpu list such as "0-3,8,10-11" into cpus in order of appearance.
+ * Returns the number of CPUs, or -1 on a syntax error.
+ */
+static int
+parse_cpu_list(const char *list, int *cpus)
+{
+    const char *p = list;
+    int count = 0;
+
+    while (*p != '\0')
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+
+        if (end == p || first < 0 || first >= PANDAS_MAX_CPUS)
+            return -1;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first || last >= PANDAS_MAX_CPUS)
+                return -1;
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && count < PANDAS_MAX_CPUS; cpu++)
+            cpus[count++] = (int) cpu;
+        while (*p == ' ')
+            p++;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return -1;
+        while (*p == ' ')
+            p++;
+    }
+
+    return count;
+}
+
+/* Validate pg_pandas.worker_cpus */
+static bool
+check_worker_cpus(char **newval, void **extra, GucSource source)
+{
+    int cpus[PANDAS_MAX_CPUS];
+
+    if (*newval != NULL && parse_cpu_list(*newval, cpus) < 0)
+    {
+        GUC_check_errdetail("Expected a list of CPU numbers and ranges below %d, such as \"0-3,8\".",
+                            PANDAS_MAX_CPUS);
+        return false;
+    }
+    return true;
+}
+
+/* NUMA node of a CPU according to sysfs, or -1 if unknown */
+static int
+cpu_numa_node(int cpu)
+{
+    char path[MAXPGPATH];
+    DIR *dir;
+    struct dirent *entry;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/*
+ * Fill a worker's CPU mask from pg_pandas.worker_cpus: the worker's own CPU,
+ * taken round-robin from the list, or in NUMA-local mode every listed CPU
+ * on that CPU's node.  The mask is left empty when no list is set.
+ */
+static void
+worker_cpu_mask(int worker_index, unsigned char *mask)
+{
+    int cpus[PANDAS_MAX_CPUS];
+    int ncpus;
+    int cpu;
+    int node;
+
+    memset(mask, 0, PANDAS_MAX_CPUS / 8);
+    if (pg_pandas_worker_cpus == NULL ||
+        (ncpus = parse_cpu_list(pg_pandas_worker_cpus, cpus)) <= 0)
+        return;
+
+    cpu = cpus[worker_index % ncpus];
+    node = pg_pandas_numa_local ? cpu_numa_node(cpu) : -1;
+    if (node < 0)
+    {
+        mask[cpu / 8] |= 1 << (cpu % 8);
+        return;
+    }
+    for (int i = 0; i < ncpus; i++)
+    {
+        if (cpu_numa_node(cpus[i]) == node)
+            mask[cpus[i] / 8] |= 1 << (cpus[i] % 8);
+    }
+}
+
+/* Initialize configuration parameters */
+void
+_PG_init(void)
+{
+    List *databases = NIL;
+    int npools;
+
+    DefineCustomIntVariable("pg_pandas.parallel",
+                            "Number of parallel pg_pandas workers",
+                            "Sets the number of parallel workers for pg_pandas, per database "
+                            "listed in pg_pandas.databases.",
+                            &pg_pandas_parallel,
+                            1,
+                            1,
+                            PANDAS_MAX_WORKERS,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.cache_refresh_interval",
+                            "Interval between logical decoding polls for cached frames",
+                            "Cached frames that follow a replication slot are patched "
+                            "with the decoded changes this often. Zero disables polling.",
+                            &pg_pandas_cache_refresh_interval,
+                            1000,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.cache_persist_interval",
+                            "Interval between writes of cached frames to disk",
+                            "Changed cached frames are written under PGDATA/pg_pandas this often "
+                            "and at shutdown, so a restart can reuse them. Zero writes only at shutdown.",
+                            &pg_pandas_cache_persist_interval,
+                            300000,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.affinity_queue_limit",
+                            "Queue length at which cache affinity is ignored",
+                            "Requests go to the worker that already holds their compiled "
+                            "operation or cached frames unless that worker has more than "
+                            "this many tasks queued; then the least-loaded worker is used.",
+                            &pg_pandas_affinity_queue_limit,
+                            2,
+                            0,
+                            MAX_TASKS,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.priority",
+                            "Scheduling priority of pg_pandas tasks",
+                            "Queued tasks with a higher priority run first; among equal "
+                            "priorities worker time is shared fairly between (database, role) "
+                            "pairs, then the one whose statement_timeout expires first runs first.",
+                            &pg_pandas_priority,
+                            0,
+                            PANDAS_MIN_PRIORITY,
+                            PANDAS_MAX_PRIORITY,
+                            PGC_SUSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.weight",
+                            "Fair-share weight of pg_pandas tasks",
+                            "Within a priority level, worker time is shared between "
+                            "(database, role) pairs in proportion to their weight.",
+                            &pg_pandas_weight,
+                            PANDAS_DEFAULT_WEIGHT,
+                            1,
+                            10000,
+                            PGC_SUSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.max_running_per_database",
+                            "Maximum number of pg_pandas tasks running at once for one database",
+                            "Taken from the submitting session, so it can be set per database "
+                            "or role. 0 means no limit.",
+                            &pg_pandas_max_running_per_database,
+                            0,
+                            0,
+                            PANDAS_MAX_WORKERS,
+                            PGC_SUSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.max_running_per_role",
+                            "Maximum number of pg_pandas tasks running at once for one role",
+                            "Taken from the submitting session, so it can be set per database "
+                            "or role. 0 means no limit.",
+                            &pg_pandas_max_running_per_role,
+                            0,
+                            0,
+                            PANDAS_MAX_WORKERS,
+                            PGC_SUSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.max_queue_depth",
+                            "Maximum number of pg_pandas tasks waiting for a worker",
+                            "Calls that would queue beyond this depth fail immediately "
+                            "instead of waiting.",
+                            &pg_pandas_max_queue_depth,
+                            128,
+                            1,
+                            MAX_TASKS,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.queue_timeout",
+                            "Maximum time a pg_pandas call waits for a worker to start it",
+                            "Zero waits without limit.",
+                            &pg_pandas_queue_timeout,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.operation_timeout",
+                            "Maximum time a pandas operation may run in a worker",
+                            "The worker interrupts operations running longer than this, "
+                            "or past the caller's statement_timeout. Zero disables the limit.",
+                            &pg_pandas_operation_timeout,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.inline_threshold",
+                            "Input size below which pandas operations run in the calling backend",
+                            "Calls whose input and operation together are smaller than this "
+                            "run in an interpreter embedded in the backend instead of a worker. "
+                            "Zero sends every call to a worker.",
+                            &pg_pandas_inline_threshold,
+                            0,
+                            0,
+                            (int) PANDAS_CHUNK_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_BYTE,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.batch_size",
+                            "Rows per batch of pandas_map_batches()",
+                            "Each batch is sent to a worker as its own DataFrame, so this "
+                            "bounds the memory a batched call needs.",
+                            &pg_pandas_batch_size,
+                            10000,
+                            1,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_pandas.executor_socket",
+                               "Unix socket of an external pg_pandas executor pool",
+                               "When set, pandas() calls are sent to the pg_pandas_executor.py "
+                               "pool listening on this socket instead of to the background workers.",
+                               &pg_pandas_executor_socket,
+                               "",
+                               PGC_SUSET,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_pandas.worker_cpus",
+                               "CPUs the pg_pandas workers are pinned to",
+                               "A cpu list such as \"0-7,16-23\"; worker i runs on the i-th "
+                               "listed CPU. Empty leaves placement to the kernel.",
+                               &pg_pandas_worker_cpus,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               check_worker_cpus, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.payload_memory",
+                            "Shared memory for the data, operations and results of pg_pandas calls",
+                            "Payloads of up to 1 MB are kept in this arena; larger ones, and any "
+                            "that find it full, get a dynamic shared memory segment of their own.",
+                            &pg_pandas_payload_memory,
+                            32,
+                            1,
+                            65536,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_MB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.spill_threshold",
+                            "Input size above which pandas() data is passed in a temporary file",
+                            "Larger inputs are written to a file in temp_tablespaces that the "
+                            "worker reads directly, instead of to shared memory. 0 never spills.",
+                            &pg_pandas_spill_threshold,
+                            65536,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.huge_page_threshold",
+                            "Input size above which pandas() data is passed in huge pages",
+                            "Larger inputs are placed in a memfd backed by huge pages, which the "
+                            "worker maps directly. Falls back to regular shared memory when no "
+                            "huge pages are available. 0 never uses huge pages.",
+                            &pg_pandas_huge_page_threshold,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SUSET,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomEnumVariable("pg_pandas.python_allocator",
+                             "Memory allocator of the Python interpreter in pg_pandas workers",
+                             "Sets PYTHONMALLOC for the workers before Python starts. mimalloc "
+                             "needs a Python built with it; otherwise pymalloc is used.",
+                             &pg_pandas_python_allocator,
+                             0,
+                             python_allocator_options,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.trim_threshold",
+                            "Task size after which a pg_pandas worker returns free memory",
+                            "After a task whose input and result together exceed this, the "
+                            "worker drops the task's objects and trims its malloc heaps, "
+                            "so the memory goes back to the operating system. 0 never trims.",
+                            &pg_pandas_trim_threshold,
+                            16384,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_KB,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.max_requests_per_worker",
+                            "Tasks a pg_pandas worker runs before it is replaced",
+                            "A fresh process takes over the worker's slot and queue, which "
+                            "bounds the fragmentation and leaks a worker accumulates. "
+                            "0 never replaces workers for this reason.",
+                            &pg_pandas_max_requests_per_worker,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pg_pandas.max_worker_rss",
+                            "Private memory above which a pg_pandas worker is replaced",
+                            "Checked after each task against the worker's resident memory, not "
+                            "counting shared memory. 0 means no limit.",
+                            &pg_pandas_max_worker_rss,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            GUC_UNIT_MB,
+                            NULL, NULL, NULL);
+
+    DefineCustomStringVariable("pg_pandas.databases",
+                               "Databases that get their own pool of pg_pandas workers",
+                               "A comma-separated list of database names. Each listed database "
+                               "gets pg_pandas.parallel workers connected to it, and calls are "
+                               "only served in these databases. Empty starts a single pool "
+                               "that serves every database without connecting to one.",
+                               &pg_pandas_databases,
+                               "",
+                               PGC_POSTMASTER,
+                               0,
+                               NULL, NULL, NULL);
+
+    DefineCustomBoolVariable("pg_pandas.numa_local",
+                             "Pin each pg_pandas worker to its NUMA node",
+                             "Instead of a single CPU, each worker may run on every CPU of "
+                             "pg_pandas.worker_cpus on the node of its assigned CPU.",
+                             &pg_pandas_numa_local,
+                             false,
+                             PGC_POSTMASTER,
+                             0,
+                             NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+    {
+        elog(ERROR, "pg_pandas must be loaded via shared_preload_libraries");
+    }
+
+    /* Names only; database OIDs cannot be looked up in the postmaster */
+    if (!SplitIdentifierString(pstrdup(pg_pandas_databases), ',', &databases))
+    {
+        elog(ERROR, "pg_pandas.databases must be a comma-separated list of database names");
+    }
+    npools = Max(list_length(databases), 1);
+    if (npools * pg_pandas_parallel > PANDAS_MAX_WORKERS)
+    {
+        elog(ERROR, "pg_pandas.parallel times the number of pg_pandas.databases must not exceed %d",
+             PANDAS_MAX_WORKERS);
+    }
+
+    /* Allocate shared memory */
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = pg_pandas_shmem_request;
+#else
+    pg_pandas_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = pg_pandas_shmem_startup;
+
+    /*
+     * Start pg_pandas.parallel background workers per pool.  Workers
+     * i * parallel to (i + 1) * parallel - 1 form pool i and find their
+     * database by that position in pg_pandas.databases.
+     */
+    for (int i = 0; i < npools * pg_pandas_parallel; i++)
+    {
+        BackgroundWorker worker;
+
+        memset(&worker, 0, sizeof(BackgroundWorker));
+        if (databases != NIL)
+            snprintf(worker.bgw_name, BGW_MAXLEN, "pg_pandas_worker %d for database %s",
+                     i % pg_pandas_parallel,
+                     (char *) list_nth(databases, i / pg_pandas_parallel));
+        else
+            snprintf(worker.bgw_name, BGW_MAXLEN, "pg_pandas_worker %d", i);
+        snprintf(worker.bgw_type, BGW_MAXLEN, "pg_pandas_worker");
+        worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+        /* Hot standbys run workers too; see pg_pandas_cache_table */
+        worker.bgw_start_time = BgWorkerStart_ConsistentState;
+        /* Workers that exit with an error, or to be recycled, are started again */
+        worker.bgw_restart_time = PANDAS_WORKER_RESTART_TIME;
+        snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_pandas_worker");
+        snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_pandas_worker_main");
+        worker.bgw_main_arg = Int32GetDatum(i);
+        worker_cpu_mask(i, (unsigned char *) worker.bgw_extra);
+
+        RegisterBackgroundWorker(&worker);
+    }
+}
+
+/* Number of tasks queued on or running in a worker; caller holds the lock */
+static int
+worker_load(PandasWorkerState *worker)
+{
+    return (worker->queue.rear - worker->queue.front) + (worker->running >= 0 ? 1 : 0);
+}
+
+/* Whether hash appears in one of a worker's advertisement rings */
+static bool
+advertised(const uint32 *ring, int size, uint32 hash)
+{
+    if (hash == 0)
+        return false;
+    for (int i = 0; i < size; i++)
+    {
+        if (ring[i] == hash)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Collect hashes of the cached frames an operation refers to as
+ * frames["name"] or frames['name'].
+ */
+static int
+referenced_frames(const char *operation, uint32 *hashes, int max)
+{
+    const char *p = operation;
+    int count = 0;
+
+    while (count < max && (p = strstr(p, "frames[")) != NULL)
+    {
+        const char *end;
+        char quote;
+
+        p += strlen("frames[");
+        if (*p != '"' && *p != '\'')
+            continue;
+        quote = *p++;
+        end = strchr(p, quote);
+        if (end == NULL)
+            break;
+        hashes[count++] = hash_bytes((const unsigned char *) p, end - p);
+        p = end + 1;
+    }
+    return count;
+}
+
+/* Whether a worker may run tasks of a database; lock held */
+static bool
+serves_database(PandasWorkerState *worker, Oid database)
+{
+    return !OidIsValid(worker->database) || worker->database == database;
+}
+
+/*
+ * Pick the worker for a task among those serving its database; caller
+ * holds the lock exclusively.
+ *
+ * Workers that advertise the task's cached frames or compiled operation
+ * are preferred, frames weighing more since rebuilding a frame view costs
+ * far more than compiling an operation.  If the best such worker already
+ * has more than pg_pandas.affinity_queue_limit tasks, the least-loaded
+ * worker is used instead.
+ */
+static int
+choose_worker(PandasTask *task)
+{
+    uint32 frames[PANDAS_ADVERTISED_FRAMES];
+    int nframes = 0;
+    int preferred = -1;
+    int preferred_score = 0;
+    int least = -1;
+
+    if (task->command == PANDAS_CMD_EXECUTE)
+    {
+        dsm_segment *seg;
+
+        nframes = referenced_frames(payload_data(pandas_shared, &task->operation, &seg),
+                                    frames, PANDAS_ADVERTISED_FRAMES);
+        if (seg != NULL)
+            dsm_detach(seg);
+    }
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        PandasWorkerState *worker = &pandas_shared->workers[i];
+        int score = 0;
+
+        if (worker->latch == NULL || worker->draining || !serves_database(worker, task->database))
+            continue;
+
+        if (least < 0 || worker_load(worker) < worker_load(&pandas_shared->workers[least]))
+            least = i;
+
+        for (int f = 0; f < nframes; f++)
+        {
+            if (advertised(worker->frames, PANDAS_ADVERTISED_FRAMES, frames[f]))
+                score += 2;
+        }
+        if (advertised(worker->operations, PANDAS_ADVERTISED_OPERATIONS, task->operation_hash))
+            score += 1;
+
+        if (score > preferred_score ||
+            (score > 0 && score == preferred_score &&
+             worker_load(worker) < worker_load(&pandas_shared->workers[preferred])))
+        {
+            preferred = i;
+            preferred_score = score;
+        }
+    }
+
+    if (preferred >= 0 &&
+        worker_load(&pandas_shared->workers[preferred]) <= pg_pandas_affinity_queue_limit)
+        return preferred;
+    return least;
+}
+
+/* Claim a free task slot for this backend to fill */
+static PandasTask *
+claim_task(PandasCommand command)
+{
+    PandasTask *task = NULL;
+
+    if (pandas_shared == NULL)
+    {
+        ereport(ERROR, (errmsg("Shared memory not initialized")));
+    }
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        if (pandas_shared->tasks[i].state == PANDAS_TASK_FREE)
+        {
+            task = &pandas_shared->tasks[i];
+            task->state = PANDAS_TASK_CLAIMED;
+            break;
+        }
+    }
+    LWLockRelease(&pandas_shared->lock);
+
+    if (task == NULL)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("pg_pandas queue is full")));
+    }
+
+    task->command = command;
+    task->owner = MyProc;
+    task->database = MyDatabaseId;
+    task->cancelled = false;
+    task->operation_hash = 0;
+    task->content_hash = 0;
+    task->refs = 1;
+    task->nwaiters = 0;
+    task->priority = pg_pandas_priority;
+    task->max_running_database = pg_pandas_max_running_per_database;
+    task->max_running_role = pg_pandas_max_running_per_role;
+    task->deadline = 0;
+    task->operation_timeout = 0;
+    task->timed_out = false;
+    if (StatementTimeout > 0)
+        task->deadline = TimestampTzPlusMilliseconds(GetCurrentStatementStartTimestamp(),
+                                                     StatementTimeout);
+    task->frame_name[0] = '\0';
+    task->key_column[0] = '\0';
+    task->slot_name[0] = '\0';
+    task->publication[0] = '\0';
+    task->relid = InvalidOid;
+    return task;
+}
+
+/*
+ * Write a payload to a new temporary file rather than shared memory, so
+ * a large input is not held in memory a second time while it waits for
+ * a worker.  The file goes to one of temp_tablespaces and counts against
+ * temp_file_limit while it is written.
+ */
+static void
+spill_payload(PandasPayload *payload, const char *src, Size len)
+{
+    char dir[MAXPGPATH];
+    char path[MAXPGPATH];
+    File file;
+
+    memset(payload, 0, sizeof(PandasPayload));
+    PrepareTempTablespaces();
+    payload->tablespace = GetNextTempTableSpace();
+    SpinLockAcquire(&pandas_shared->arena_lock);
+    payload->file = pandas_shared->next_spill_file++;
+    SpinLockRelease(&pandas_shared->arena_lock);
+
+    TempTablespacePath(dir, payload->tablespace);
+    PathNameCreateTemporaryDir(dir, dir);
+    payload_file_path(payload, path);
+    file = PathNameCreateTemporaryFile(path, true);
+
+    /* From here on, freeing the payload removes the file */
+    payload->kind = PANDAS_PAYLOAD_FILE;
+    payload->len = len;
+
+    for (Size written = 0; written < len;)
+    {
+        int amount = (int) Min(len - written, (Size) 1 << 20);
+
+        if (FileWrite(file, (char *) src + written, amount, written, PG_WAIT_EXTENSION) != amount)
+        {
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not write to file \"%s\": %m", path)));
+        }
+        written += amount;
+    }
+    FileClose(file);
+}
+
+/* Size of the system's default huge pages, or 0 if it has none */
+static Size
+huge_page_size(void)
+{
+    static Size size = (Size) -1;
+
+    if (size == (Size) -1)
+    {
+        FILE *meminfo = fopen("/proc/meminfo", "r");
+        char line[128];
+        unsigned long kb;
+
+        size = 0;
+        while (meminfo != NULL && fgets(line, sizeof(line), meminfo) != NULL)
+        {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1)
+            {
+                size = (Size) kb * 1024;
+                break;
+            }
+        }
+        if (meminfo != NULL)
+            fclose(meminfo);
+    }
+    return size;
+}
+
+/*
+ * Put a payload in a memfd backed by huge pages, so a large input costs
+ * this backend and the worker few TLB entries.  The worker maps it through
+ * /proc/<pid>/fd; the descriptor stays open until this backend lets go of
+ * the task.  Returns false if the huge page pool cannot hold it.
+ */
+static bool
+store_huge_payload(PandasPayload *payload, const char *src, Size len)
+{
+#if defined(__linux__) && defined(MFD_HUGETLB)
+    Size page = huge_page_size();
+    Size size;
+    char *addr;
+    int fd;
+
+    if (page == 0)
+        return false;
+    size = TYPEALIGN(page, len + 1);
+
+    fd = memfd_create("pg_pandas_payload", MFD_CLOEXEC | MFD_HUGETLB);
+    if (fd < 0)
+        return false;
+    /* Huge pages are reserved by mmap, which fails if the pool is short */
+    if (ftruncate(fd, size) != 0 ||
+        (addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        elog(DEBUG1, "no huge pages for a pg_pandas payload of %zu bytes: %m", len);
+        close(fd);
+        return false;
+    }
+    memcpy(addr, src, len);
+    addr[len] = '\0';
+    munmap(addr, size);
+
+    memset(payload, 0, sizeof(PandasPayload));
+    payload->kind = PANDAS_PAYLOAD_MEMFD;
+    payload->len = len;
+    payload->pid = MyProcPid;
+    payload->fd = fd;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Copy a payload of a claimed task into shared memory.  With may_spill,
+ * a payload above pg_pandas.spill_threshold goes to a temporary file, and
+ * one above pg_pandas.huge_page_threshold to huge pages if there are any.
+ * On failure the slot is given back before the error is raised.
+ */
+static void
+store_payload(PandasTask *task, PandasPayload *payload, const char *src, Size len, bool may_spill)
+{
+    bool stored = false;
+
+    PG_TRY();
+    {
+        if (may_spill && pg_pandas_spill_threshold > 0 &&
+            len > (Size) pg_pandas_spill_threshold * 1024)
+        {
+            spill_payload(payload, src, len);
+            stored = true;
+        }
+        else if (may_spill && pg_pandas_huge_page_threshold > 0 &&
+                 len > (Size) pg_pandas_huge_page_threshold * 1024 &&
+                 store_huge_payload(payload, src, len))
+            stored = true;
+        else
+            stored = payload_store(pandas_shared, payload, src, len);
+    }
+    PG_CATCH();
+    {
+        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        free_task(pandas_shared, task);
+        LWLockRelease(&pandas_shared->lock);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    if (!stored)
+    {
+        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        free_task(pandas_shared, task);
+        LWLockRelease(&pandas_shared->lock);
+        ereport(ERROR,
+                (errcode(ERRCODE_OUT_OF_MEMORY),
+                 errmsg("out of pg_pandas payload memory"),
+                 errdetail("No dynamic shared memory segment is left for a payload of %zu bytes.", len)));
+    }
+}
+
+/* palloc'd copy of a payload */
+static char *
+copy_payload(const PandasPayload *payload)
+{
+    dsm_segment *seg;
+    const char *data = payload_data(pandas_shared, payload, &seg);
+    char *copy = palloc(payload->len + 1);
+
+    memcpy(copy, data, payload->len);
+    copy[payload->len] = '\0';
+    if (seg != NULL)
+        dsm_detach(seg);
+    return copy;
+}
+
+/*
+ * Whether two payloads may hold the same bytes: same length and both in
+ * shared memory.  Spilled and huge page inputs are never compared, so such
+ * calls are not coalesced and a memfd payload always has one reader.
+ */
+static bool
+payloads_comparable(const PandasPayload *a, const PandasPayload *b)
+{
+    return a->len == b->len && a->kind < PANDAS_PAYLOAD_FILE && b->kind < PANDAS_PAYLOAD_FILE;
+}
+
+/*
+ * Whether two comparable payloads hold the same bytes.  Called without the
+ * lock, so both tasks must be pinned.
+ */
+static bool
+payloads_equal(const PandasPayload *a, const PandasPayload *b)
+{
+    dsm_segment *seg_a;
+    dsm_segment *seg_b;
+    bool equal;
+
+    equal = memcmp(payload_data(pandas_shared, a, &seg_a),
+                   payload_data(pandas_shared, b, &seg_b), a->len) == 0;
+    if (seg_a != NULL)
+        dsm_detach(seg_a);
+    if (seg_b != NULL)
+        dsm_detach(seg_b);
+    return equal;
+}
+
+/* Count a queued task against this session's tenant entry; lock held */
+static int
+attach_tenant(void)
+{
+    Oid role = GetUserId();
+    int free_slot = -1;
+    PandasTenant *tenant;
+
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        tenant = &pandas_shared->tenants[i];
+        if (tenant->queued == 0 && tenant->running == 0)
+        {
+            if (free_slot < 0)
+                free_slot = i;
+            continue;
+        }
+        if (tenant->database == MyDatabaseId && tenant->role == role)
+        {
+            tenant->weight = pg_pandas_weight;
+            tenant->queued++;
+            return i;
+        }
+    }
+
+    /* A tenant becoming active starts at the current virtual time, so idling earns no credit */
+    tenant = &pandas_shared->tenants[free_slot];
+    tenant->database = MyDatabaseId;
+    tenant->role = role;
+    tenant->weight = pg_pandas_weight;
+    tenant->queued = 1;
+    tenant->running = 0;
+    tenant->service = pandas_shared->virtual_time;
+    tenant->estimate = 0;
+    return free_slot;
+}
+
+/* Number of tasks waiting for a worker to start them; lock held */
+static int
+queue_depth(void)
+{
+    int depth = 0;
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+        depth += pandas_shared->workers[i].queue.rear - pandas_shared->workers[i].queue.front;
+
+    return depth;
+}
+
+/* Take a queued task back out of its worker queue and free it; lock held */
+static bool
+withdraw_task(PandasTask *task)
+{
+    int task_index = task - pandas_shared->tasks;
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        PandasTaskQueue *queue = &pandas_shared->workers[i].queue;
+
+        for (int pos = queue->front; pos != queue->rear; pos++)
+        {
+            if (queue->tasks[pos % MAX_TASKS] != task_index)
+                continue;
+
+            /* Fill the hole with the entry at the front */
+            queue->tasks[pos % MAX_TASKS] = queue->tasks[queue->front % MAX_TASKS];
+            queue->front++;
+            pandas_shared->tenants[task->tenant].queued--;
+            free_task(pandas_shared, task);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * An execute task already queued or running with the same hash and payload
+ * sizes, which can take another waiter; lock held.  The bytes are compared
+ * by the caller once the lock is released.  Only tasks whose limits are no
+ * tighter than this one's qualify, so that a waiter never fails on another
+ * session's statement_timeout or pg_pandas.operation_timeout; its own
+ * statement_timeout still cancels its wait.
+ */
+static PandasTask *
+find_identical_task(PandasTask *task)
+{
+    if (task->command != PANDAS_CMD_EXECUTE)
+        return NULL;
+
+    for (int i = 0; i < MAX_TASKS; i++)
+    {
+        PandasTask *other = &pandas_shared->tasks[i];
+
+        if (other == task || other->command != PANDAS_CMD_EXECUTE ||
+            other->content_hash != task->content_hash || other->database != task->database)
+            continue;
+        if ((other->state != PANDAS_TASK_QUEUED && other->state != PANDAS_TASK_RUNNING) ||
+            other->cancelled || other->nwaiters >= PANDAS_MAX_WAITERS)
+            continue;
+        if (other->deadline != 0 && (task->deadline == 0 || other->deadline < task->deadline))
+            continue;
+        /* A running task's operation_timeout counts from its start, which was earlier */
+        if (other->operation_timeout != task->operation_timeout ||
+            (other->operation_timeout > 0 && other->state != PANDAS_TASK_QUEUED))
+            continue;
+        if (payloads_comparable(&other->operation, &task->operation) &&
+            payloads_comparable(&other->data, &task->data))
+            return other;
+    }
+
+    return NULL;
+}
+
+/*
+ * Stop waiting for a dispatched task.  The last backend interested in it
+ * frees the slot, or takes it back out of its queue, or marks it cancelled
+ * and returns the pid of the worker running it, which should be
+ * interrupted; otherwise returns 0.  Lock held.
+ */
+static int
+release_task(PandasTask *task)
+{
+    if (task->owner == MyProc)
+        task->owner = NULL;
+    else
+    {
+        for (int i = 0; i < task->nwaiters; i++)
+        {
+            if (task->waiters[i] == MyProc)
+            {
+                task->waiters[i] = task->waiters[--task->nwaiters];
+                break;
+            }
+        }
+    }
+
+    if (--task->refs > 0)
+        return 0;
+
+    if (task->state == PANDAS_TASK_DONE || task->state == PANDAS_TASK_FAILED)
+    {
+        free_task(pandas_shared, task);
+        return 0;
+    }
+    if (task->state == PANDAS_TASK_QUEUED && withdraw_task(task))
+        return 0;
+
+    task->cancelled = true;
+
+    /* The worker frees the slot, but only this backend can close its memfd */
+    if (task->data.kind == PANDAS_PAYLOAD_MEMFD && task->data.pid == MyProcPid)
+    {
+        close(task->data.fd);
+        task->data.pid = 0;
+    }
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        if (pandas_shared->workers[i].running == task - pandas_shared->tasks)
+            return pandas_shared->workers[i].pid;
+    }
+    return 0;
+}
+
+/*
+ * Error cleanup while waiting, which also covers query cancel and client
+ * disconnect.  If no other backend waits for the task, a queued task is
+ * taken back out of its queue and a running one is marked cancelled and
+ * its worker sent SIGINT to abort the Python code.
+ */
+static void
+abandon_task(int code, Datum arg)
+{
+    PandasTask *task = (PandasTask *) DatumGetPointer(arg);
+    int worker_pid;
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    worker_pid = release_task(task);
+    LWLockRelease(&pandas_shared->lock);
+
+    if (worker_pid != 0)
+        kill(worker_pid, SIGINT);
+}
+
+/*
+ * Queue a filled task on the chosen worker and wake it.  If an identical
+ * request is already in flight, the slot is released and this backend
+ * waits for that task instead; returns the task to wait for.
+ */
+static PandasTask *
+dispatch_task(PandasTask *task)
+{
+    struct Latch *latch = NULL;
+    struct Latch *idle_latch = NULL;
+    PandasTask *leader;
+    int worker_index;
+    int leader_pid = 0;
+    bool full;
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+
+    leader = find_identical_task(task);
+    if (leader != NULL)
+    {
+        bool same;
+
+        /* Join the candidate, which pins its payloads while they are compared unlocked */
+        leader->waiters[leader->nwaiters++] = MyProc;
+        leader->refs++;
+        LWLockRelease(&pandas_shared->lock);
+
+        PG_ENSURE_ERROR_CLEANUP(abandon_task, PointerGetDatum(leader));
+        {
+            same = payloads_equal(&leader->operation, &task->operation) &&
+                   payloads_equal(&leader->data, &task->data);
+        }
+        PG_END_ENSURE_ERROR_CLEANUP(abandon_task, PointerGetDatum(leader));
+
+        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        if (same)
+        {
+            leader->priority = Max(leader->priority, task->priority);
+            free_task(pandas_shared, task);
+            LWLockRelease(&pandas_shared->lock);
+            return leader;
+        }
+
+        /* Only the hash matched; leave the candidate and queue this task */
+        leader_pid = release_task(leader);
+    }
+
+    full = queue_depth() >= pg_pandas_max_queue_depth;
+    worker_index = full ? -1 : choose_worker(task);
+    if (worker_index >= 0)
+    {
+        PandasWorkerState *worker = &pandas_shared->workers[worker_index];
+
+        worker->queue.tasks[worker->queue.rear % MAX_TASKS] = task - pandas_shared->tasks;
+        worker->queue.rear++;
+        task->sequence = pandas_shared->next_sequence++;
+        task->tenant = attach_tenant();
+        task->state = PANDAS_TASK_QUEUED;
+        latch = worker->latch;
+
+        /* If the chosen worker is busy, let an idle one steal the task */
+        if (worker->running >= 0)
+        {
+            for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+            {
+                PandasWorkerState *other = &pandas_shared->workers[i];
+
+                if (other->latch != NULL && other->running < 0 && !other->draining &&
+                    serves_database(other, task->database) &&
+                    other->queue.front == other->queue.rear)
+                {
+                    idle_latch = other->latch;
+                    break;
+                }
+            }
+        }
+    }
+    else
+        free_task(pandas_shared, task);
+
+    LWLockRelease(&pandas_shared->lock);
+
+    /* The candidate's other waiters gave up while it was pinned */
+    if (leader_pid != 0)
+        kill(leader_pid, SIGINT);
+
+    if (full)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                 errmsg("pg_pandas queue is full"),
+                 errdetail("%d tasks are already waiting for a worker.", pg_pandas_max_queue_depth)));
+    }
+    if (latch == NULL)
+    {
+        if (pg_pandas_databases != NULL && pg_pandas_databases[0] != '\0')
+            ereport(ERROR,
+                    (errmsg("no pg_pandas worker is running for this database"),
+                     errhint("Workers are only started for the databases listed in pg_pandas.databases.")));
+        ereport(ERROR, (errmsg("no pg_pandas worker is running")));
+    }
+
+    /* Signal worker to process */
+    SetLatch(latch);
+    if (idle_latch != NULL)
+        SetLatch(idle_latch);
+
+    return task;
+}
+
+/* Wait for a dispatched task, release its slot and return its result */
+static char *
+wait_for_task(PandasTask *task)
+{
+    PandasTaskState state;
+    char *result;
+    bool timed_out;
+    TimestampTz queue_deadline = 0;
+
+    if (pg_pandas_queue_timeout > 0)
+        queue_deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                     pg_pandas_queue_timeout);
+
+    PG_ENSURE_ERROR_CLEANUP(abandon_task, PointerGetDatum(task));
+    {
+        for (;;)
+        {
+            int events = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+            long timeout = -1L;
+
+            LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+            state = task->state;
+            LWLockRelease(&pandas_shared->lock);
+
+            if (state == PANDAS_TASK_DONE || state == PANDAS_TASK_FAILED)
+                break;
+
+            /* Only the time spent queued counts against pg_pandas.queue_timeout */
+            if (state == PANDAS_TASK_QUEUED && queue_deadline != 0)
+            {
+                timeout = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), queue_deadline);
+                if (timeout <= 0)
+                {
+                    ereport(ERROR,
+                            (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+                             errmsg("timed out waiting for a pg_pandas worker"),
+                             errhint("Consider raising pg_pandas.parallel or pg_pandas.queue_timeout.")));
+                }
+                events |= WL_TIMEOUT;
+            }
+
+            (void) WaitLatch(MyLatch, events, timeout, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+        }
+    }
+    PG_END_ENSURE_ERROR_CLEANUP(abandon_task, PointerGetDatum(task));
+
+    result = copy_payload(&task->result);
+    timed_out = task->timed_out;
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    (void) release_task(task);
+    LWLockRelease(&pandas_shared->lock);
+
+    if (state == PANDAS_TASK_FAILED && timed_out)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_QUERY_CANCELED),
+                 errmsg("pg_pandas operation timed out"),
+                 errdetail("%s", result)));
+    }
+    if (state == PANDAS_TASK_FAILED)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                 errmsg("pg_pandas operation failed"),
+                 errdetail("%s", result)));
+    }
+
+    return result;
+}
+
+/*
+ * Hand an operation to the workers and return the task to wait for.  With
+ * spread, the task is placed by load only and not by the operation the
+ * workers have compiled, so the shards of one request land on different
+ * workers.
+ */
+static PandasTask *
+submit_operation(const char *data, size_t data_len, const char *operation, size_t operation_len,
+                 int priority, bool spread)
+{
+    PandasTask *task;
+    uint32 operation_hash;
+
+    task = claim_task(PANDAS_CMD_EXECUTE);
+    task->priority = priority;
+    task->operation_timeout = pg_pandas_operation_timeout;
+    store_payload(task, &task->data, data, data_len, true);
+    store_payload(task, &task->operation, operation, operation_len, false);
+    operation_hash = hash_bytes((const unsigned char *) operation, operation_len);
+    task->operation_hash = spread ? 0 : operation_hash;
+    task->content_hash = hash_combine(operation_hash,
+                                      hash_bytes((const unsigned char *) data, data_len));
+
+    return dispatch_task(task);
+}
+
+/*
+ * Run a small operation in this backend's own interpreter, skipping the
+ * handoff to a worker.  The interpreter comes from pg_pandas_worker and is
+ * sandboxed the same way.
+ */
+static char *
+execute_inline(const char *data, size_t data_len, const char *operation, size_t operation_len)
+{
+    static PandasInlineExecute inline_execute = NULL;
+    PandasTask *task;
+    char *result;
+    bool ok;
+    bool timed_out;
+
+    if (inline_execute == NULL)
+        inline_execute = (PandasInlineExecute)
+            load_external_function("pg_pandas_worker", "pg_pandas_inline_execute", true, NULL);
+
+    /*
+     * A private task; its payloads still live in the shared arena.  Query
+     * cancel and statement_timeout interrupt the operation through SIGINT,
+     * pg_pandas.operation_timeout through the task.
+     */
+    task = palloc0(sizeof(PandasTask));
+    task->command = PANDAS_CMD_EXECUTE;
+    task->started = GetCurrentTimestamp();
+    task->operation_timeout = pg_pandas_operation_timeout;
+    store_payload(task, &task->data, data, data_len, false);
+    store_payload(task, &task->operation, operation, operation_len, false);
+
+    PG_TRY();
+    {
+        ok = inline_execute(task);
+        result = copy_payload(&task->result);
+    }
+    PG_CATCH();
+    {
+        free_task(pandas_shared, task);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    timed_out = task->timed_out;
+    free_task(pandas_shared, task);
+    pfree(task);
 
-PG_MODULE_MAGIC;
+    if (!ok)
+    {
+        /* Cancelled or past statement_timeout: report that, not the KeyboardInterrupt */
+        CHECK_FOR_INTERRUPTS();
+        if (timed_out)
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_QUERY_CANCELED),
+                     errmsg("pg_pandas operation timed out"),
+                     errdetail("%s", result)));
+        }
+        ereport(ERROR,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                 errmsg("pg_pandas operation failed"),
+                 errdetail("%s", result)));
+    }
+
+    return result;
+}
 
+#ifdef __linux__
+/* Request and reply headers of the executor protocol, see pg_pandas_executor.py */
 typedef struct {
-    char data[8192];
-    char operation[2048];
-    char result[65536];
-    bool ready;
-    bool terminate;
-    LWLock lock;
-} PandasSharedData;
+    uint32 data_len;
+    uint32 operation_len;
+} PandasExecutorRequest;
 
-static PandasSharedData *pandas_shared = NULL;
-int pg_pandas_parallel = 1;  /* Default value */
+typedef struct {
+    int32 status;               /* 0 ok, 1 error */
+    uint32 length;
+} PandasExecutorReply;
 
-void _PG_init(void);
-Datum pg_pandas_fn(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(pg_pandas_fn);
+/* Send header with fd attached */
+static bool
+send_with_fd(int sock, const void *header, Size len, int fd)
+{
+    struct msghdr msg = {0};
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
 
-/* Initialize configuration parameters */
-void
-_PG_init(void)
+    iov.iov_base = (void *) header;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    return sendmsg(sock, &msg, 0) == (ssize_t) len;
+}
+
+/* Receive header and the fd attached to it; *fd is -1 if there was none */
+static bool
+recv_with_fd(int sock, void *header, Size len, int *fd)
 {
-    DefineCustomIntVariable("pg_pandas.parallel",
-                            "Number of parallel pg_pandas workers",
-                            "Sets the number of parallel workers for pg_pandas.",
-                            &pg_pandas_parallel,
-                            1,
-                            1,
-                            1024, /* Set maximum to 1024 */
-                            PGC_POSTMASTER,
-                            0,
-                            NULL, NULL, NULL);
+    struct msghdr msg = {0};
+    struct iovec iov;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t received;
 
-    /* Allocate shared memory */
-    bool found;
-    pandas_shared = (PandasSharedData *) ShmemInitStruct("pg_pandas_shared",
-                                                         sizeof(PandasSharedData),
-                                                         &found);
+    *fd = -1;
+    iov.iov_base = header;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
 
-    if (!found)
+    received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
     {
-        /* Initialize shared memory */
-        memset(pandas_shared, 0, sizeof(PandasSharedData));
-        LWLockInitialize(&pandas_shared->lock, LWLockNewTrancheId());
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
     }
 
-    if (!process_shared_preload_libraries_in_progress)
+    return received == (ssize_t) len && *fd >= 0;
+}
+
+/*
+ * Run an operation in the external executor pool at
+ * pg_pandas.executor_socket.  The input and operation are written once
+ * into a memfd whose descriptor is passed over the socket, and the result
+ * comes back the same way, so payloads are not streamed through the socket
+ * and are not limited by the task slot sizes.
+ */
+static char *
+execute_in_executor(const char *data, size_t data_len, const char *operation, size_t operation_len)
+{
+    volatile int sock = -1;
+    volatile int request_fd = -1;
+    volatile int reply_fd = -1;
+    PandasExecutorRequest request;
+    PandasExecutorReply reply;
+    struct sockaddr_un addr;
+    char *result = NULL;
+
+    PG_TRY();
     {
-        elog(ERROR, "pg_pandas must be loaded via shared_preload_libraries");
+        char *buf;
+        int fd;
+
+        if (strlen(pg_pandas_executor_socket) >= sizeof(addr.sun_path))
+            ereport(ERROR, (errmsg("pg_pandas.executor_socket is too long")));
+
+        /* Write the payload into a memfd */
+        request_fd = memfd_create("pg_pandas_request", MFD_CLOEXEC);
+        if (request_fd < 0 || ftruncate(request_fd, data_len + operation_len) != 0)
+            ereport(ERROR, (errmsg("could not create pg_pandas request buffer: %m")));
+        if (data_len + operation_len > 0)
+        {
+            buf = mmap(NULL, data_len + operation_len, PROT_READ | PROT_WRITE, MAP_SHARED, request_fd, 0);
+            if (buf == MAP_FAILED)
+                ereport(ERROR, (errmsg("could not map pg_pandas request buffer: %m")));
+            memcpy(buf, data, data_len);
+            memcpy(buf + data_len, operation, operation_len);
+            munmap(buf, data_len + operation_len);
+        }
+
+        sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strlcpy(addr.sun_path, pg_pandas_executor_socket, sizeof(addr.sun_path));
+        if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+            ereport(ERROR,
+                    (errmsg("could not connect to pg_pandas executor at \"%s\": %m",
+                            pg_pandas_executor_socket)));
+
+        request.data_len = data_len;
+        request.operation_len = operation_len;
+        if (!send_with_fd(sock, &request, sizeof(request), request_fd))
+            ereport(ERROR, (errmsg("could not send request to pg_pandas executor: %m")));
+        close(request_fd);
+        request_fd = -1;
+
+        /* Wait for the reply; closing the socket on cancel abandons the request */
+        for (;;)
+        {
+            int events = WaitLatchOrSocket(MyLatch,
+                                           WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH,
+                                           sock, -1L, PG_WAIT_EXTENSION);
+
+            if (events & WL_LATCH_SET)
+                ResetLatch(MyLatch);
+            CHECK_FOR_INTERRUPTS();
+            if (events & WL_SOCKET_READABLE)
+                break;
+        }
+
+        if (!recv_with_fd(sock, &reply, sizeof(reply), &fd))
+            ereport(ERROR, (errmsg("pg_pandas executor closed the connection without a reply")));
+        reply_fd = fd;
+
+        result = palloc(reply.length + 1);
+        if (reply.length > 0)
+        {
+            buf = mmap(NULL, reply.length, PROT_READ, MAP_SHARED, reply_fd, 0);
+            if (buf == MAP_FAILED)
+                ereport(ERROR, (errmsg("could not map pg_pandas executor reply: %m")));
+            memcpy(result, buf, reply.length);
+            munmap(buf, reply.length);
+        }
+        result[reply.length] = '\0';
     }
+    PG_CATCH();
+    {
+        if (request_fd >= 0)
+            close(request_fd);
+        if (reply_fd >= 0)
+            close(reply_fd);
+        if (sock >= 0)
+            close(sock);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
 
-    if (pg_pandas_parallel < 1 || pg_pandas_parallel > 16)
+    close(reply_fd);
+    close(sock);
+
+    if (reply.status != 0)
     {
-        elog(ERROR, "pg_pandas.parallel must be between 1 and 16");
+        ereport(ERROR,
+                (errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+                 errmsg("pg_pandas operation failed"),
+                 errdetail("%s", result)));
     }
+
+    return result;
+}
+#else
+static char *
+execute_in_executor(const char *data, size_t data_len, const char *operation, size_t operation_len)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+             errmsg("pg_pandas.executor_socket is only supported on Linux")));
+    return NULL;
+}
+#endif
+
+/*
+ * Bump context for the buffers of one call that are dead once its result
+ * datum is built: detoasted input, results copied out of shared memory
+ * and the partitions of a partitioned request.  Nothing in it is freed
+ * individually, so a generation context avoids per-chunk bookkeeping, and
+ * deleting it drops everything at once instead of at the end of the query.
+ */
+static MemoryContext
+create_call_context(MemoryContext parent)
+{
+#if PG_VERSION_NUM >= 150000
+    return GenerationContextCreate(parent, "pg_pandas call", ALLOCSET_DEFAULT_SIZES);
+#else
+    return GenerationContextCreate(parent, "pg_pandas call", SLAB_LARGE_BLOCK_SIZE);
+#endif
 }
 
 /* Function to execute Pandas operations */
@@ -87,6 +1673,12 @@ pg_pandas_fn(PG_FUNCTION_ARGS)
         /* Switch to multi-call memory context */
         funcctx = SRF_FIRSTCALL_INIT();
 
+        /* Like a strict function, a null input or operation returns no rows */
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+            SRF_RETURN_DONE(funcctx);
+
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
         /* Allocate a tuple descriptor for result */
         TupleDesc tupdesc;
         if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
@@ -99,48 +1691,61 @@ pg_pandas_fn(PG_FUNCTION_ARGS)
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
         funcctx->max_calls = 1;
 
-        /* Setup shared memory and lock */
-        if (pandas_shared == NULL)
-        {
-            ereport(ERROR, (errmsg("Shared memory not initialized")));
-        }
+        MemoryContext call_context = create_call_context(funcctx->multi_call_memory_ctx);
+        char *result;
 
-        /* Acquire lock */
-        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        MemoryContextSwitchTo(call_context);
+
+        /* Get input arguments, detoasted into the call context */
+        struct varlena *input_data = PG_DETOAST_DATUM_PACKED(PG_GETARG_DATUM(0));
+        text *operation_text = PG_GETARG_TEXT_PP(1);
+        int priority = pg_pandas_priority;
 
-        /* Check if worker is ready */
-        if (!pandas_shared->ready)
+        if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
         {
-            LWLockRelease(&pandas_shared->lock);
-            ereport(ERROR, (errmsg("pg_pandas worker is busy")));
+            priority = PG_GETARG_INT32(2);
+            if (priority < PANDAS_MIN_PRIORITY || priority > PANDAS_MAX_PRIORITY)
+            {
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("priority must be between %d and %d",
+                                PANDAS_MIN_PRIORITY, PANDAS_MAX_PRIORITY)));
+            }
+            /* A call may lower its priority, but not raise it past the session's */
+            priority = Min(priority, pg_pandas_priority);
         }
 
-        /* Get input arguments */
-        Datum input_data = PG_GETARG_DATUM(0);
-        text *operation_text = PG_GETARG_TEXT_P(1);
-
         /* Serialize input data and operation to shared memory */
         size_t data_len = VARSIZE_ANY_EXHDR(input_data);
         size_t operation_len = VARSIZE_ANY_EXHDR(operation_text);
 
-        if (data_len >= sizeof(pandas_shared->data))
+        bool use_executor = pg_pandas_executor_socket != NULL && pg_pandas_executor_socket[0] != '\0';
+
+        if (use_executor)
         {
-            LWLockRelease(&pandas_shared->lock);
-            ereport(ERROR, (errmsg("Input data size exceeds buffer capacity")));
+            result = execute_in_executor(VARDATA_ANY(input_data), data_len,
+                                         VARDATA_ANY(operation_text), operation_len);
         }
-
-        if (operation_len >= sizeof(pandas_shared->operation))
+        else if (data_len + operation_len < (size_t) pg_pandas_inline_threshold)
         {
-            LWLockRelease(&pandas_shared->lock);
-            ereport(ERROR, (errmsg("Operation size exceeds buffer capacity")));
+            result = execute_inline(VARDATA_ANY(input_data), data_len,
+                                    VARDATA_ANY(operation_text), operation_len);
+        }
+        else
+        {
+            PandasTask *task = submit_operation(VARDATA_ANY(input_data), data_len,
+                                                VARDATA_ANY(operation_text), operation_len,
+                                                priority, false);
+
+            result = wait_for_task(task);
         }
 
-        memcpy(pandas_shared->data, VARDATA_ANY(input_data), data_len);
-        memcpy(pandas_shared->operation, VARDATA_ANY(operation_text), operation_len);
-        pandas_shared->ready = false;
+        /* Only the result datum outlives the first call */
+        MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        funcctx->user_fctx = cstring_to_text(result);
+        MemoryContextDelete(call_context);
 
-        /* Signal worker to process */
-        LWLockRelease(&pandas_shared->lock);
+        MemoryContextSwitchTo(oldcontext);
     }
 
     /* Per-call state */
@@ -148,28 +1753,481 @@ pg_pandas_fn(PG_FUNCTION_ARGS)
 
     if (funcctx->call_cntr < 1)
     {
-        /* Acquire lock to read result */
-        LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+        /* Return the result built on the first call, without copying it */
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(funcctx->user_fctx));
+    }
+    else
+    {
+        /* No more results */
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+/* Shards of a partitioned request */
+typedef struct {
+    PandasTask *tasks[PANDAS_MAX_WORKERS];
+    int ntasks;
+    int next;                   /* first shard not waited for yet */
+} PandasShards;
+
+/* Error cleanup: give up on the shards not waited for yet */
+static void
+abandon_shards(int code, Datum arg)
+{
+    PandasShards *shards = (PandasShards *) DatumGetPointer(arg);
+
+    for (int i = shards->next; i < shards->ntasks; i++)
+        abandon_task(code, PointerGetDatum(shards->tasks[i]));
+}
+
+/*
+ * Split a JSON array of records into at most nshards arrays by the hash of
+ * key_column, allocated in the caller's context; returns the number of
+ * non-empty shards
+ */
+static int
+partition_records(text *data, const char *key_column, int nshards, char **shards)
+{
+    Oid argtypes[3] = {TEXTOID, TEXTOID, INT4OID};
+    Datum values[3];
+    MemoryContext caller = CurrentMemoryContext;
+    int count;
+
+    values[0] = PointerGetDatum(data);
+    values[1] = CStringGetTextDatum(key_column);
+    values[2] = Int32GetDatum(nshards);
+
+    SPI_connect();
+    if (SPI_execute_with_args("SELECT json_agg(e)::text FROM json_array_elements($1::json) AS e "
+                              "GROUP BY (hashtext(e->>$2) & 2147483647) % $3",
+                              3, argtypes, values, NULL, true, 0) != SPI_OK_SELECT)
+    {
+        ereport(ERROR, (errmsg("could not partition pg_pandas input")));
+    }
+    count = SPI_processed;
+    for (int i = 0; i < count; i++)
+        shards[i] = MemoryContextStrdup(caller,
+                                        SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1));
+    SPI_finish();
+
+    return count;
+}
+
+/* Concatenate JSON arrays of records, as returned by the workers, into one */
+static char *
+concat_records(char **parts, int nparts)
+{
+    StringInfoData buf;
+    bool empty = true;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '[');
+    for (int i = 0; i < nparts; i++)
+    {
+        const char *start = parts[i];
+        const char *end = start + strlen(start);
 
-        if (!pandas_shared->ready)
+        while (start < end && isspace((unsigned char) *start))
+            start++;
+        while (end > start && isspace((unsigned char) end[-1]))
+            end--;
+        if (end - start < 2 || *start != '[' || end[-1] != ']')
         {
-            LWLockRelease(&pandas_shared->lock);
-            ereport(ERROR, (errmsg("pg_pandas operation not completed")));
+            ereport(ERROR,
+                    (errmsg("pg_pandas shard result is not a JSON array"),
+                     errdetail("Partitioned operations must return a DataFrame or Series.")));
         }
+        start++;
+        end--;
+        while (start < end && isspace((unsigned char) *start))
+            start++;
+        if (start == end)
+            continue;
 
-        /* Prepare result tuple */
-        Datum result;
-        bool isnull = false;
-        result = CStringGetTextDatum(pandas_shared->result);
+        if (!empty)
+            appendStringInfoChar(&buf, ',');
+        appendBinaryStringInfo(&buf, start, end - start);
+        empty = false;
+    }
+    appendStringInfoChar(&buf, ']');
 
-        LWLockRelease(&pandas_shared->lock);
+    return buf.data;
+}
+
+/*
+ * Run one operation over several workers: the input, a JSON array of
+ * records, is split by the hash of key_column into shards, each shard is
+ * processed by a different worker and the results are concatenated.  For
+ * aggregates that do not decompose by key, reduce is applied to the
+ * concatenation as a final step.
+ */
+Datum
+pg_pandas_partitioned_fn(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        funcctx->max_calls = 1;
+
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+        {
+            ereport(ERROR, (errmsg("data, operation and key_column must not be null")));
+        }
+
+        MemoryContext call_context = create_call_context(funcctx->multi_call_memory_ctx);
+
+        MemoryContextSwitchTo(call_context);
+
+        text *data = PG_GETARG_TEXT_PP(0);
+        char *operation = text_to_cstring(PG_GETARG_TEXT_PP(1));
+        char *key_column = text_to_cstring(PG_GETARG_TEXT_PP(2));
+        int nshards = PG_ARGISNULL(3) ? pg_pandas_parallel : PG_GETARG_INT32(3);
+        char *reduce = PG_ARGISNULL(4) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(4));
+        char *parts[PANDAS_MAX_WORKERS];
+        char *results[PANDAS_MAX_WORKERS];
+        PandasShards shards;
+        char *result;
+        int nparts;
+
+        if (nshards < 1 || nshards > PANDAS_MAX_WORKERS)
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("shards must be between 1 and %d", PANDAS_MAX_WORKERS)));
+        }
+
+        nparts = partition_records(data, key_column, nshards, parts);
+
+        memset(&shards, 0, sizeof(shards));
+        PG_ENSURE_ERROR_CLEANUP(abandon_shards, PointerGetDatum(&shards));
+        {
+            for (int i = 0; i < nparts; i++)
+                shards.tasks[shards.ntasks++] = submit_operation(parts[i], strlen(parts[i]),
+                                                                 operation, strlen(operation),
+                                                                 pg_pandas_priority, true);
+            for (int i = 0; i < nparts; i++)
+            {
+                shards.next = i + 1;
+                results[i] = wait_for_task(shards.tasks[i]);
+            }
+        }
+        PG_END_ENSURE_ERROR_CLEANUP(abandon_shards, PointerGetDatum(&shards));
+
+        result = concat_records(results, nparts);
+        if (reduce != NULL)
+        {
+            PandasTask *task = submit_operation(result, strlen(result), reduce, strlen(reduce),
+                                                pg_pandas_priority, false);
+
+            result = wait_for_task(task);
+        }
+
+        MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        funcctx->user_fctx = cstring_to_text(result);
+        MemoryContextDelete(call_context);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
 
-        /* Return result */
-        SRF_RETURN_NEXT(funcctx, result);
+    if (funcctx->call_cntr < 1)
+    {
+        SRF_RETURN_NEXT(funcctx, PointerGetDatum(funcctx->user_fctx));
     }
     else
     {
-        /* No more results */
         SRF_RETURN_DONE(funcctx);
     }
+}
+
+/* State of a pandas_map_batches() call between batches */
+typedef struct {
+    char *portal_name;          /* cursor over the rows of the query, as JSON */
+    char *operation;
+    int batch_size;
+} PandasBatches;
+
+/*
+ * Next batch of up to batch_size rows from the cursor of a batched call,
+ * as a JSON array of records in the caller's context.  Returns NULL and
+ * closes the cursor once it is exhausted.
+ */
+static char *
+fetch_batch(PandasBatches *batches, size_t *len)
+{
+    StringInfoData buf;
+    Portal portal;
+
+    initStringInfo(&buf);
+    SPI_connect();
+    portal = SPI_cursor_find(batches->portal_name);
+    if (portal == NULL)
+        ereport(ERROR, (errmsg("cursor \"%s\" of pandas_map_batches does not exist",
+                               batches->portal_name)));
+    SPI_cursor_fetch(portal, true, batches->batch_size);
+    if (SPI_processed == 0)
+    {
+        SPI_cursor_close(portal);
+        SPI_finish();
+        return NULL;
+    }
+
+    appendStringInfoChar(&buf, '[');
+    for (uint64 i = 0; i < SPI_processed; i++)
+    {
+        char *record = SPI_getvalue(SPI_tuptable->vals[i], SPI_tuptable->tupdesc, 1);
+
+        if (i > 0)
+            appendStringInfoChar(&buf, ',');
+        appendStringInfoString(&buf, record);
+        pfree(record);
+    }
+    appendStringInfoChar(&buf, ']');
+    SPI_finish();
+
+    *len = buf.len;
+    return buf.data;
+}
+
+/*
+ * Apply a row-local operation to the rows of a query in batches.  The
+ * query runs in a cursor; each call of the function fetches the next
+ * batch_size rows, has a worker apply the operation to them as one
+ * DataFrame and returns that batch's result as a row, so neither the
+ * backend nor the worker ever holds more than one batch of input.  Called
+ * in the select list the rows stream; in FROM, FunctionScan materializes
+ * them first.  Only operations whose result
+ * for a row does not depend on other rows give the same answer as
+ * pandas() over the whole input.
+ */
+Datum
+pg_pandas_map_batches_fn(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    MemoryContext oldcontext;
+    PandasBatches *batches;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+        {
+            ereport(ERROR, (errmsg("query and operation must not be null")));
+        }
+
+        batches = palloc0(sizeof(PandasBatches));
+        batches->operation = text_to_cstring(PG_GETARG_TEXT_PP(1));
+        batches->batch_size = PG_ARGISNULL(2) ? pg_pandas_batch_size : PG_GETARG_INT32(2);
+        if (batches->batch_size < 1)
+        {
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("batch_size must be positive")));
+        }
+
+        /* The cursor is left open across calls; it closes at the latest with the transaction */
+        char *query = psprintf("SELECT row_to_json(s)::text FROM (%s) AS s",
+                               text_to_cstring(PG_GETARG_TEXT_PP(0)));
+        Portal portal;
+
+        SPI_connect();
+        portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, false, 0);
+        batches->portal_name = MemoryContextStrdup(funcctx->multi_call_memory_ctx, portal->name);
+        SPI_finish();
+
+        funcctx->user_fctx = batches;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    batches = (PandasBatches *) funcctx->user_fctx;
+
+    /*
+     * The batch and its intermediate copies go with the call context; the
+     * result datum is made in the caller's per-row context, so memory does
+     * not grow with the number of batches.
+     */
+    MemoryContext call_context = create_call_context(CurrentMemoryContext);
+    size_t data_len;
+    char *data;
+    char *result = NULL;
+
+    oldcontext = MemoryContextSwitchTo(call_context);
+    data = fetch_batch(batches, &data_len);
+    if (data != NULL)
+    {
+        PandasTask *task = submit_operation(data, data_len, batches->operation,
+                                            strlen(batches->operation), pg_pandas_priority, false);
+
+        result = wait_for_task(task);
+    }
+    MemoryContextSwitchTo(oldcontext);
+
+    if (result == NULL)
+    {
+        MemoryContextDelete(call_context);
+        SRF_RETURN_DONE(funcctx);
+    }
+
+    text *datum = cstring_to_text(result);
+
+    MemoryContextDelete(call_context);
+    SRF_RETURN_NEXT(funcctx, PointerGetDatum(datum));
+}
+
+/* Check that a name argument fits a fixed-size shared memory field */
+static const char *
+check_name_field(const char *src, const char *what)
+{
+    if (src == NULL)
+        return "";
+    if (strlen(src) >= NAMEDATALEN)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_NAME_TOO_LONG),
+                 errmsg("%s \"%s\" is too long", what, src)));
+    }
+    return src;
+}
+
+/* Hand a cached frame command over to a worker and wait for it */
+static void
+submit_cache_command(PandasCommand command, const char *frame_name,
+                     Oid relid, const char *key_column,
+                     const char *slot_name, const char *publication)
+{
+    char *relation = NULL;
+    PandasTask *task;
+
+    frame_name = check_name_field(frame_name, "frame name");
+    key_column = check_name_field(key_column, "key column");
+    slot_name = check_name_field(slot_name, "slot name");
+    publication = check_name_field(publication, "publication");
+
+    if (OidIsValid(relid))
+    {
+        /* Same spelling test_decoding uses in its "table ...:" prefix */
+        relation = quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+                                              get_rel_name(relid));
+    }
+
+    task = claim_task(command);
+    strlcpy(task->frame_name, frame_name, NAMEDATALEN);
+    strlcpy(task->key_column, key_column, NAMEDATALEN);
+    strlcpy(task->slot_name, slot_name, NAMEDATALEN);
+    strlcpy(task->publication, publication, NAMEDATALEN);
+    task->relid = relid;
+    if (relation != NULL)
+        store_payload(task, &task->data, relation, strlen(relation), false);
+
+    dispatch_task(task);
+    (void) wait_for_task(task);
+}
+
+/*
+ * Load a table into a named DataFrame kept by the worker.
+ *
+ * When a logical replication slot is given, the worker keeps the frame
+ * fresh by applying the decoded inserts, updates and deletes as patches
+ * keyed on key_column instead of reloading the whole table.
+ */
+Datum
+pg_pandas_cache_table(PG_FUNCTION_ARGS)
+{
+    if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2))
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("name, source and key_column must not be null")));
+    }
+
+    char *frame_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    Oid relid = PG_GETARG_OID(1);
+    char *key_column = text_to_cstring(PG_GETARG_TEXT_PP(2));
+    char *slot_name = PG_ARGISNULL(3) ? NULL : NameStr(*PG_GETARG_NAME(3));
+    char *publication = PG_ARGISNULL(4) ? NULL : NameStr(*PG_GETARG_NAME(4));
+    AclResult aclresult;
+
+    if (get_rel_name(relid) == NULL)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("relation with OID %u does not exist", relid)));
+    }
+
+    /*
+     * The worker reads the table as its own role and every session can read
+     * the frame afterwards, so the caller must be able to read all of it.
+     */
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK)
+        aclcheck_error(aclresult, get_relkind_objtype(get_rel_relkind(relid)),
+                       get_rel_name(relid));
+    if (check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("cannot cache \"%s\" because row-level security applies to it",
+                        get_rel_name(relid))));
+    }
+
+    /* Consuming a slot needs the REPLICATION attribute */
+    if (slot_name != NULL && !has_rolreplication(GetUserId()))
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("must be superuser or replication role to follow a replication slot")));
+    }
+
+    /* Following a slot consumes it, which a standby cannot do */
+    if (slot_name != NULL && RecoveryInProgress())
+    {
+        ereport(ERROR,
+                (errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+                 errmsg("cannot follow a replication slot during recovery"),
+                 errhint("Cache the frame without a slot and call pandas_cache_table again to pick up replayed changes.")));
+    }
+
+    submit_cache_command(PANDAS_CMD_CACHE_LOAD, frame_name, relid,
+                         key_column, slot_name, publication);
+
+    PG_RETURN_VOID();
+}
+
+/* Drop a cached frame and stop following its slot */
+Datum
+pg_pandas_cache_drop(PG_FUNCTION_ARGS)
+{
+    char *frame_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    submit_cache_command(PANDAS_CMD_CACHE_DROP, frame_name, InvalidOid,
+                         NULL, NULL, NULL);
+
+    PG_RETURN_VOID();
+}
+
+/* Number of pg_pandas tasks currently waiting for a worker */
+Datum
+pg_pandas_queue_depth(PG_FUNCTION_ARGS)
+{
+    int depth;
+
+    if (pandas_shared == NULL)
+    {
+        ereport(ERROR, (errmsg("Shared memory not initialized")));
+    }
+
+    LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+    depth = queue_depth();
+    LWLockRelease(&pandas_shared->lock);
+
+    PG_RETURN_INT32(depth);
 }
\ No newline at end of file
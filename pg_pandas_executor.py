@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+# pg_pandas_executor.py
+#
+# Pre-forked pool of Python processes that run pandas operations for
+# pg_pandas outside the PostgreSQL server.  Set pg_pandas.executor_socket to
+# the socket this script listens on and pandas() calls are sent here instead
+# of to the background workers.
+#
+# Each request is one connection.  The backend sends the header below with
+# a memfd attached (SCM_RIGHTS) that holds the input JSON followed by the
+# operation; the reply carries a status header and a memfd with the result
+# JSON, or with the error message.  Payloads are never copied through the
+# socket.
+#
+# Usage: pg_pandas_executor.py SOCKET [--processes N]
+# Run it as the operating system user of the PostgreSQL server.
+
+import argparse
+import io
+import json
+import mmap
+import os
+import signal
+import socket
+import struct
+import sys
+
+import numpy as np
+import pandas as pd
+import pyarrow as pa
+
+REQUEST = struct.Struct('=II')  # input length, operation length
+REPLY = struct.Struct('=iI')    # status (0 ok, 1 error), result length
+
+# Compiled operations, evicted oldest first like in the workers
+_operations = {}
+
+# Operations see the same names as in the workers: the allowed modules and
+# a few builtins, but nothing to import or open files with
+_BUILTINS = {'print': print, 'len': len, 'range': range}
+
+
+def _operation(source):
+    operation = _operations.get(source)
+    if operation is None:
+        if len(_operations) >= 64:
+            _operations.pop(next(iter(_operations)))
+        scope = {'__builtins__': _BUILTINS, 'pd': pd, 'np': np, 'pa': pa, 'json': json}
+        operation = eval(compile(source, '<operation>', 'eval'), scope)
+        _operations[source] = operation
+    return operation
+
+
+def _reply(conn, status, text):
+    payload = text.encode()
+    fd = os.memfd_create('pg_pandas_result', os.MFD_CLOEXEC)
+    try:
+        os.ftruncate(fd, len(payload))
+        if payload:
+            with mmap.mmap(fd, len(payload)) as buf:
+                buf[:] = payload
+        socket.send_fds(conn, [REPLY.pack(status, len(payload))], [fd])
+    finally:
+        os.close(fd)
+
+
+def _serve(conn):
+    header, fds, _flags, _addr = socket.recv_fds(conn, REQUEST.size, 1)
+    if len(header) != REQUEST.size or len(fds) != 1:
+        for fd in fds:
+            os.close(fd)
+        return
+    data_len, operation_len = REQUEST.unpack(header)
+    try:
+        if data_len + operation_len == 0:
+            # mmap() refuses empty mappings
+            data = source = ''
+        else:
+            with mmap.mmap(fds[0], data_len + operation_len, prot=mmap.PROT_READ) as buf:
+                data = buf[:data_len].decode()
+                source = buf[data_len:data_len + operation_len].decode()
+    finally:
+        os.close(fds[0])
+
+    try:
+        df = pd.read_json(io.StringIO(data))
+        result = _operation(source)(df)
+        _reply(conn, 0, result.to_json(orient='records'))
+    except Exception as e:
+        _reply(conn, 1, '%s: %s' % (type(e).__name__, e))
+
+
+def _child(listener):
+    signal.signal(signal.SIGTERM, signal.SIG_DFL)
+    signal.signal(signal.SIGINT, signal.SIG_DFL)
+    while True:
+        conn, _addr = listener.accept()
+        with conn:
+            try:
+                _serve(conn)
+            except Exception:
+                # The backend went away (e.g. after a query cancel) or
+                # sent a malformed request
+                pass
+
+
+def _spawn(listener):
+    pid = os.fork()
+    if pid == 0:
+        try:
+            _child(listener)
+        finally:
+            os._exit(1)
+    return pid
+
+
+def main():
+    parser = argparse.ArgumentParser(description='pg_pandas executor pool')
+    parser.add_argument('socket', help='path of the Unix domain socket to listen on')
+    parser.add_argument('--processes', type=int, default=os.cpu_count() or 1,
+                        help='number of executor processes (default: number of CPUs)')
+    args = parser.parse_args()
+
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    # Create the socket private to the server's user; a chmod after bind
+    # would leave a window in which anyone could connect
+    umask = os.umask(0o177)
+    try:
+        listener.bind(args.socket)
+    finally:
+        os.umask(umask)
+    listener.listen(128)
+
+    children = set(_spawn(listener) for _ in range(max(args.processes, 1)))
+
+    def shutdown(signum, frame):
+        for pid in children:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+        try:
+            os.unlink(args.socket)
+        except FileNotFoundError:
+            pass
+        sys.exit(0)
+
+    signal.signal(signal.SIGTERM, shutdown)
+    signal.signal(signal.SIGINT, shutdown)
+
+    # Replace executors that crash or are killed, e.g. by the OOM killer
+    while True:
+        pid, status = os.wait()
+        if pid in children:
+            children.discard(pid)
+            print('pg_pandas executor %d exited with status %d, restarting' % (pid, status),
+                  file=sys.stderr)
+            children.add(_spawn(listener))
+
+
+if __name__ == '__main__':
+    main()
@@ -6,92 +6,2306 @@
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_type.h"
+#include "common/hashfn.h"
+#include "executor/spi.h"
+#include "mb/pg_wchar.h"
+#include "pgstat.h"
 #include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
 #include "storage/shmem.h"
 #include "storage/lwlock.h"
 #include "miscadmin.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+#include "utils/timeout.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include <Python.h>
 #include <cjson/cJSON.h>
 
+#include "payload.h"
+
 PG_MODULE_MAGIC;
 
-/* Shared memory structure for communication */
-typedef struct {
-    char data[8192];
-    char operation[2048];
-    char result[65536];
-    bool ready;
-    bool terminate;
-    LWLock lock;
-} PandasSharedData;
+/* Pointer to shared memory */
+static PandasSharedData *pandas_shared = NULL;
+
+/* This worker's slot in pandas_shared->workers */
+static int MyWorkerIndex = -1;
+
+/* Database whose cached frames this process sees, InvalidOid for all */
+static Oid frames_database = InvalidOid;
+
+static volatile sig_atomic_t got_sigterm = false;
+
+/* Task being processed, for the cancel handler */
+static PandasTask *volatile current_task = NULL;
+
+/* Timer limiting the run time of a task */
+static TimeoutId operation_timeout_id;
+static volatile sig_atomic_t operation_timed_out = false;
+
+/* Function declarations */
+void pg_pandas_worker_main(Datum main_arg);
+bool pg_pandas_inline_execute(PandasTask *task);
+static bool process_pandas_operation(PandasTask *task);
+static bool process_cache_command(PandasTask *task);
+static void refresh_cached_frames(void);
+static void persist_cached_frames(void);
+static void restore_cached_frames(bool restore);
+
+/* Directory under PGDATA holding persisted cached frames */
+#define PG_PANDAS_CACHE_DIR "pg_pandas"
+
+/* List of allowed Python modules */
+const char *allowed_modules[] = {"pandas", "numpy", "pyarrow", "json", NULL};
+
+/* Helpers run in __main__ of every interpreter, defined below */
+static const char *cache_python_source;
+
+/* Signal handler for shutdown */
+static void
+handle_shutdown(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+    got_sigterm = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+/*
+ * SIGINT handler: the backend waiting for the running task gave up.  Raise
+ * KeyboardInterrupt in the Python code so the worker is free again; the
+ * signal is ignored if the task has already finished.
+ */
+static void
+handle_cancel(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+    PandasTask *task = current_task;
+
+    if (task != NULL && task->cancelled)
+        PyErr_SetInterrupt();
+    errno = save_errno;
+}
+
+/*
+ * SIGINT handler of a backend running an operation inline: query cancel and
+ * statement_timeout (which signals SIGINT) also interrupt the Python code.
+ */
+static void
+handle_inline_cancel(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+
+    StatementCancelHandler(postgres_signal_arg);
+    if (current_task != NULL)
+        PyErr_SetInterrupt();
+    errno = save_errno;
+}
+
+/* Timeout handler: the running task is past its deadline or operation_timeout */
+static void
+handle_operation_timeout(void)
+{
+    operation_timed_out = true;
+    PyErr_SetInterrupt();
+}
+
+/* When the task must be interrupted, or 0 if it may run indefinitely */
+static TimestampTz
+task_stop_time(PandasTask *task)
+{
+    TimestampTz stop_at = task->deadline;
+
+    if (task->operation_timeout > 0)
+    {
+        TimestampTz limit = TimestampTzPlusMilliseconds(task->started, task->operation_timeout);
+
+        if (stop_at == 0 || limit < stop_at)
+            stop_at = limit;
+    }
+
+    return stop_at;
+}
+
+/*
+ * Pin this worker to the CPUs in the mask pg_pandas placed in bgw_extra
+ * (see pg_pandas.worker_cpus).  Done before Python starts, so that memory
+ * the worker touches first is allocated on its own NUMA node.
+ */
+static void
+pin_worker(void)
+{
+#ifdef __linux__
+    const unsigned char *mask = (const unsigned char *) MyBgworkerEntry->bgw_extra;
+    cpu_set_t set;
+    bool any = false;
+
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < BGW_EXTRALEN * 8 && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (mask[cpu / 8] & (1 << (cpu % 8)))
+        {
+            CPU_SET(cpu, &set);
+            any = true;
+        }
+    }
+
+    if (any && sched_setaffinity(0, sizeof(set), &set) != 0)
+        ereport(WARNING, (errmsg("could not set CPU affinity of pg_pandas worker: %m")));
+#endif
+}
+
+/* Record hash in one of this worker's advertisement rings */
+static void
+advertise(uint32 *ring, int *next, int size, uint32 hash)
+{
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < size; i++)
+    {
+        if (ring[i] == hash)
+        {
+            LWLockRelease(&pandas_shared->lock);
+            return;
+        }
+    }
+    ring[*next] = hash;
+    *next = (*next + 1) % size;
+    LWLockRelease(&pandas_shared->lock);
+}
+
+/*
+ * _pg_pandas module.
+ *
+ * Gives the worker's Python code access to the shared cached frame
+ * registry.  A Segment object maps one DSM segment and exposes it through
+ * the read-only buffer protocol; the mapping is dropped once the last
+ * Arrow buffer or pandas column built on top of it goes away.
+ */
+typedef struct {
+    PyObject_HEAD
+    dsm_segment *seg;
+    Size size;
+} PandasSegmentObject;
+
+static int
+segment_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+    PandasSegmentObject *segment = (PandasSegmentObject *) self;
+
+    return PyBuffer_FillInfo(view, self, dsm_segment_address(segment->seg),
+                             segment->size, 1, flags);
+}
+
+static void
+segment_dealloc(PyObject *self)
+{
+    PandasSegmentObject *segment = (PandasSegmentObject *) self;
+
+    if (segment->seg != NULL)
+        dsm_detach(segment->seg);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyBufferProcs segment_as_buffer = {
+    .bf_getbuffer = segment_getbuffer,
+};
+
+static PyTypeObject PandasSegmentType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "_pg_pandas.Segment",
+    .tp_basicsize = sizeof(PandasSegmentObject),
+    .tp_dealloc = segment_dealloc,
+    .tp_as_buffer = &segment_as_buffer,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+/*
+ * Find a registry entry by name among the frames of this process's
+ * database, or a free entry for an empty name; caller holds frames_lock
+ */
+static PandasCachedFrame *
+find_cached_frame(const char *name)
+{
+    for (int i = 0; i < PANDAS_MAX_CACHED_FRAMES; i++)
+    {
+        PandasCachedFrame *frame = &pandas_shared->frames[i];
+
+        if (strcmp(frame->name, name) == 0 &&
+            (name[0] == '\0' || frame->database == frames_database))
+            return frame;
+    }
+    return NULL;
+}
+
+/*
+ * Turn the PostgreSQL error caught by PG_CATCH into a Python exception.
+ * Functions called from Python must not let an error longjmp through the
+ * interpreter.
+ */
+static void
+raise_python_from_error(MemoryContext context)
+{
+    ErrorData *edata;
+
+    MemoryContextSwitchTo(context);
+    edata = CopyErrorData();
+    FlushErrorState();
+    PyErr_SetString(PyExc_RuntimeError, edata->message);
+    FreeErrorData(edata);
+}
+
+/* frame_version(name) -> current version, or None if not cached */
+static PyObject *
+pg_pandas_frame_version(PyObject *self, PyObject *args)
+{
+    const char *name;
+    PandasCachedFrame *frame;
+    uint64 version = 0;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    if (name[0] == '\0')
+        Py_RETURN_NONE;
+
+    LWLockAcquire(&pandas_shared->frames_lock, LW_SHARED);
+    frame = find_cached_frame(name);
+    if (frame != NULL)
+        version = frame->version;
+    LWLockRelease(&pandas_shared->frames_lock);
+
+    if (version == 0)
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLongLong(version);
+}
+
+/*
+ * Map a frame segment for Python; caller holds frames_lock.  Returns NULL
+ * with a Python exception set on failure.
+ */
+static PyObject *
+attach_segment(dsm_handle handle, Size size, MemoryContext context)
+{
+    PandasSegmentObject *segment;
+    bool failed = false;
+
+    segment = PyObject_New(PandasSegmentObject, &PandasSegmentType);
+    if (segment == NULL)
+        return NULL;
+    segment->seg = NULL;
+    segment->size = size;
+
+    PG_TRY();
+    {
+        segment->seg = dsm_attach(handle);
+        /* Keep it past the current transaction when running inline in a backend */
+        if (segment->seg != NULL)
+            dsm_pin_mapping(segment->seg);
+    }
+    PG_CATCH();
+    {
+        raise_python_from_error(context);
+        failed = true;
+    }
+    PG_END_TRY();
+
+    if (!failed && segment->seg == NULL)
+        PyErr_SetString(PyExc_RuntimeError, "cached frame segment is gone");
+    if (failed || segment->seg == NULL)
+    {
+        Py_DECREF(segment);
+        return NULL;
+    }
+    return (PyObject *) segment;
+}
+
+/*
+ * attach_frame(name) -> (version, base_version, Segment, Segment or None),
+ * the base copy and the changed rows, or None if not cached
+ */
+static PyObject *
+pg_pandas_attach_frame(PyObject *self, PyObject *args)
+{
+    const char *name;
+    PandasCachedFrame *frame;
+    PyObject *base = NULL;
+    PyObject *delta = NULL;
+    MemoryContext context = CurrentMemoryContext;
+    uint64 version = 0;
+    uint64 base_version = 0;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+    if (name[0] == '\0')
+        Py_RETURN_NONE;
+
+    /* Publishers unpin replaced segments under the exclusive lock */
+    LWLockAcquire(&pandas_shared->frames_lock, LW_SHARED);
+    frame = find_cached_frame(name);
+    if (frame != NULL)
+    {
+        version = frame->version;
+        base_version = frame->base_version;
+        base = attach_segment(frame->handle, frame->size, context);
+        if (base != NULL && frame->delta_handle != DSM_HANDLE_INVALID)
+            delta = attach_segment(frame->delta_handle, frame->delta_size, context);
+        else if (base != NULL)
+        {
+            Py_INCREF(Py_None);
+            delta = Py_None;
+        }
+    }
+    LWLockRelease(&pandas_shared->frames_lock);
+
+    if (frame == NULL)
+        Py_RETURN_NONE;
+    if (base == NULL || delta == NULL)
+    {
+        Py_XDECREF(base);
+        return NULL;
+    }
+
+    return Py_BuildValue("(KKNN)", (unsigned long long) version,
+                         (unsigned long long) base_version, base, delta);
+}
+
+/*
+ * Copy buffer into a new segment that outlives this process's mapping.
+ * Returns NULL with a Python exception set on failure.
+ */
+static dsm_segment *
+create_segment(Py_buffer *buffer, MemoryContext context)
+{
+    dsm_segment *volatile seg = NULL;
+    bool failed = false;
+
+    PG_TRY();
+    {
+        seg = dsm_create(buffer->len, 0);
+        memcpy(dsm_segment_address(seg), buffer->buf, buffer->len);
+
+        /* Keep the segment alive after this worker detaches from it */
+        dsm_pin_segment(seg);
+    }
+    PG_CATCH();
+    {
+        raise_python_from_error(context);
+        failed = true;
+    }
+    PG_END_TRY();
+
+    if (failed)
+    {
+        if (seg != NULL)
+            dsm_detach(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+/* publish_frame(name, buffer) -> version; replaces any previous copy and its changes */
+static PyObject *
+pg_pandas_publish_frame(PyObject *self, PyObject *args)
+{
+    const char *name;
+    Py_buffer buffer;
+    PandasCachedFrame *frame;
+    dsm_segment *seg;
+    dsm_handle handle;
+    Size size;
+    uint64 version = 0;
+
+    if (!PyArg_ParseTuple(args, "sy*", &name, &buffer))
+        return NULL;
+
+    size = buffer.len;
+    seg = create_segment(&buffer, CurrentMemoryContext);
+    PyBuffer_Release(&buffer);
+    if (seg == NULL)
+        return NULL;
+    handle = dsm_segment_handle(seg);
+
+    LWLockAcquire(&pandas_shared->frames_lock, LW_EXCLUSIVE);
+    frame = find_cached_frame(name);
+    if (frame != NULL)
+    {
+        dsm_unpin_segment(frame->handle);
+        if (frame->delta_handle != DSM_HANDLE_INVALID)
+            dsm_unpin_segment(frame->delta_handle);
+    }
+    else
+        frame = find_cached_frame("");
+
+    if (frame != NULL)
+    {
+        strlcpy(frame->name, name, NAMEDATALEN);
+        frame->database = frames_database;
+        frame->handle = handle;
+        frame->size = size;
+        frame->delta_handle = DSM_HANDLE_INVALID;
+        frame->delta_size = 0;
+        frame->version = ++pandas_shared->frames_generation;
+        frame->base_version = frame->version;
+        version = frame->version;
+    }
+    else
+        dsm_unpin_segment(handle);
+    LWLockRelease(&pandas_shared->frames_lock);
+
+    dsm_detach(seg);
+
+    if (version == 0)
+    {
+        PyErr_Format(PyExc_MemoryError, "too many cached frames (maximum is %d)",
+                     PANDAS_MAX_CACHED_FRAMES);
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(version);
+}
+
+/*
+ * publish_delta(name, buffer) -> version, or None if the frame is no
+ * longer cached; replaces the changed rows and keeps the base copy
+ */
+static PyObject *
+pg_pandas_publish_delta(PyObject *self, PyObject *args)
+{
+    const char *name;
+    Py_buffer buffer;
+    PandasCachedFrame *frame;
+    dsm_segment *seg;
+    Size size;
+    uint64 version = 0;
+
+    if (!PyArg_ParseTuple(args, "sy*", &name, &buffer))
+        return NULL;
+
+    size = buffer.len;
+    seg = create_segment(&buffer, CurrentMemoryContext);
+    PyBuffer_Release(&buffer);
+    if (seg == NULL)
+        return NULL;
+
+    LWLockAcquire(&pandas_shared->frames_lock, LW_EXCLUSIVE);
+    frame = name[0] != '\0' ? find_cached_frame(name) : NULL;
+    if (frame != NULL)
+    {
+        if (frame->delta_handle != DSM_HANDLE_INVALID)
+            dsm_unpin_segment(frame->delta_handle);
+        frame->delta_handle = dsm_segment_handle(seg);
+        frame->delta_size = size;
+        frame->version = ++pandas_shared->frames_generation;
+        version = frame->version;
+    }
+    else
+        dsm_unpin_segment(dsm_segment_handle(seg));
+    LWLockRelease(&pandas_shared->frames_lock);
+
+    dsm_detach(seg);
+
+    if (version == 0)
+        Py_RETURN_NONE;
+    return PyLong_FromUnsignedLongLong(version);
+}
+
+/* drop_frame(name): release the shared copy */
+static PyObject *
+pg_pandas_drop_frame(PyObject *self, PyObject *args)
+{
+    const char *name;
+    PandasCachedFrame *frame;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    LWLockAcquire(&pandas_shared->frames_lock, LW_EXCLUSIVE);
+    frame = name[0] != '\0' ? find_cached_frame(name) : NULL;
+    if (frame != NULL)
+    {
+        dsm_unpin_segment(frame->handle);
+        if (frame->delta_handle != DSM_HANDLE_INVALID)
+            dsm_unpin_segment(frame->delta_handle);
+        memset(frame, 0, sizeof(PandasCachedFrame));
+    }
+    LWLockRelease(&pandas_shared->frames_lock);
+
+    Py_RETURN_NONE;
+}
+
+/* advertise_frame(name): tell the dispatcher this worker has a view of it */
+static PyObject *
+pg_pandas_advertise_frame(PyObject *self, PyObject *args)
+{
+    const char *name;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    /* Inline operations run in a backend, which has no worker slot */
+    if (MyWorkerIndex >= 0)
+    {
+        PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+
+        advertise(worker->frames, &worker->next_frame, PANDAS_ADVERTISED_FRAMES,
+                  hash_bytes((const unsigned char *) name, strlen(name)));
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* connected() -> whether this worker can run queries through execute() */
+static PyObject *
+pg_pandas_connected(PyObject *self, PyObject *args)
+{
+    return PyBool_FromLong(OidIsValid(frames_database) && !IsTransactionState());
+}
+
+/*
+ * One value of a row SPI returned: text in the server encoding, converted
+ * to UTF-8, except bytea, which is returned as bytes, and nulls as None
+ */
+static PyObject *
+spi_value(HeapTuple tuple, TupleDesc desc, int col)
+{
+    bool isnull;
+    Datum datum = SPI_getbinval(tuple, desc, col, &isnull);
+    char *text;
+
+    if (isnull)
+        Py_RETURN_NONE;
+    if (SPI_gettypeid(desc, col) == BYTEAOID)
+    {
+        bytea *data = DatumGetByteaPP(datum);
+
+        return PyBytes_FromStringAndSize(VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+    }
+    text = SPI_getvalue(tuple, desc, col);
+    return PyUnicode_FromString((char *) pg_server_to_any(text, strlen(text), PG_UTF8));
+}
+
+/* The rows SPI returned as (names, type oids, rows) */
+static PyObject *
+spi_result(void)
+{
+    TupleDesc desc;
+    PyObject *names;
+    PyObject *types;
+    PyObject *rows;
+    bool ok;
+
+    if (SPI_tuptable == NULL)
+        return Py_BuildValue("([][][])");
+
+    /* The lists hold NULL items until they are filled, which they tolerate */
+    desc = SPI_tuptable->tupdesc;
+    names = PyList_New(desc->natts);
+    types = PyList_New(desc->natts);
+    rows = PyList_New(SPI_processed);
+    ok = names != NULL && types != NULL && rows != NULL;
+    for (int col = 0; ok && col < desc->natts; col++)
+    {
+        PyObject *name = PyUnicode_FromString(SPI_fname(desc, col + 1));
+        PyObject *type = PyLong_FromUnsignedLong(SPI_gettypeid(desc, col + 1));
+
+        PyList_SET_ITEM(names, col, name);
+        PyList_SET_ITEM(types, col, type);
+        ok = name != NULL && type != NULL;
+    }
+    for (uint64 i = 0; ok && i < SPI_processed; i++)
+    {
+        PyObject *row = PyTuple_New(desc->natts);
+
+        PyList_SET_ITEM(rows, i, row);
+        ok = row != NULL;
+        for (int col = 0; ok && col < desc->natts; col++)
+        {
+            PyObject *value = spi_value(SPI_tuptable->vals[i], desc, col + 1);
+
+            PyTuple_SET_ITEM(row, col, value);
+            ok = value != NULL;
+        }
+    }
+
+    if (!ok)
+    {
+        Py_XDECREF(names);
+        Py_XDECREF(types);
+        Py_XDECREF(rows);
+        return NULL;
+    }
+    return Py_BuildValue("(NNN)", names, types, rows);
+}
+
+/*
+ * execute(sql) -> (names, type oids, rows): run one statement through SPI
+ * in a transaction of its own.  Only the workers of a pg_pandas.databases
+ * pool are connected to a database; see connected().
+ */
+static PyObject *
+pg_pandas_execute(PyObject *self, PyObject *args)
+{
+    const char *sql;
+    MemoryContext context = CurrentMemoryContext;
+    PyObject *volatile result = NULL;
+    bool failed = false;
+
+    if (!PyArg_ParseTuple(args, "s", &sql))
+        return NULL;
+    if (!OidIsValid(frames_database) || IsTransactionState())
+    {
+        PyErr_SetString(PyExc_RuntimeError, "only workers connected to a database can run queries");
+        return NULL;
+    }
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PG_TRY();
+    {
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+        pgstat_report_activity(STATE_RUNNING, sql);
+        SPI_execute(sql, false, 0);
+        result = spi_result();
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        raise_python_from_error(context);
+        AbortCurrentTransaction();
+        failed = true;
+    }
+    PG_END_TRY();
+    MemoryContextSwitchTo(context);
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    if (failed)
+    {
+        Py_XDECREF(result);
+        return NULL;
+    }
+    return result;
+}
+
+static PyMethodDef pg_pandas_methods[] = {
+    {"frame_version", pg_pandas_frame_version, METH_VARARGS, NULL},
+    {"attach_frame", pg_pandas_attach_frame, METH_VARARGS, NULL},
+    {"publish_frame", pg_pandas_publish_frame, METH_VARARGS, NULL},
+    {"publish_delta", pg_pandas_publish_delta, METH_VARARGS, NULL},
+    {"drop_frame", pg_pandas_drop_frame, METH_VARARGS, NULL},
+    {"advertise_frame", pg_pandas_advertise_frame, METH_VARARGS, NULL},
+    {"connected", pg_pandas_connected, METH_NOARGS, NULL},
+    {"execute", pg_pandas_execute, METH_VARARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef pg_pandas_module = {
+    PyModuleDef_HEAD_INIT, "_pg_pandas", NULL, -1, pg_pandas_methods
+};
+
+static PyObject *
+PyInit__pg_pandas(void)
+{
+    if (PyType_Ready(&PandasSegmentType) < 0)
+        return NULL;
+    return PyModule_Create(&pg_pandas_module);
+}
+
+/*
+ * Select the interpreter's allocator (pg_pandas.python_allocator) through
+ * PYTHONMALLOC, which Py_Initialize reads.  Called before Python starts.
+ */
+static void
+set_python_allocator(void)
+{
+    const char *allocator = GetConfigOption("pg_pandas.python_allocator", true, false);
+
+    if (allocator == NULL || strcmp(allocator, "default") == 0)
+        return;
+#ifndef WITH_MIMALLOC
+    /* Python refuses to start with an allocator it was built without */
+    if (strcmp(allocator, "mimalloc") == 0)
+    {
+        ereport(WARNING,
+                (errmsg("Python was built without mimalloc, pg_pandas workers use pymalloc")));
+        allocator = "pymalloc";
+    }
+#endif
+    setenv("PYTHONMALLOC", allocator, 1);
+}
+
+/*
+ * Initialize secure Python environment.
+ *
+ * Operations are compiled against their own globals, whose builtins are
+ * only those in _pg_pandas_builtins (see _pg_pandas_operation).  The
+ * interpreter's builtins module stays intact: pandas and the helpers in
+ * cache_python_source look names up in it whenever they run.
+ */
+static void initialize_secure_python(void) {
+    PyImport_AppendInittab("_pg_pandas", PyInit__pg_pandas);
+    Py_Initialize();
+
+    /* Import only allowed modules */
+    for (int i = 0; allowed_modules[i] != NULL; i++) {
+        char import_command[256];
+        snprintf(import_command, sizeof(import_command), "import %s", allowed_modules[i]);
+        if (PyRun_SimpleString(import_command) != 0)
+            ereport(FATAL, (errmsg("pg_pandas could not import Python module \"%s\"", allowed_modules[i])));
+    }
+
+    /* Restrict built-in functions */
+    if (PyRun_SimpleString("_pg_pandas_builtins = {'print': print, 'len': len, 'range': range}\n") != 0 ||
+        PyRun_SimpleString(cache_python_source) != 0)
+        ereport(FATAL, (errmsg("pg_pandas could not set up its Python helpers")));
+}
+
+/*
+ * Cached frames.
+ *
+ * Operations see cached frames as frames[name].  The worker that loads a
+ * frame keeps a private copy to patch and publishes it as Arrow IPC into
+ * shared memory (see the _pg_pandas module); every worker reads that one
+ * shared copy.  A frame loaded with a replication slot is kept fresh by
+ * decoding the slot (test_decoding or pgoutput) and patching the frame by
+ * key, which costs work proportional to the change volume rather than to
+ * the size of the table.
+ */
+static const char *cache_python_source =
+    "import _pg_pandas\n"
+    "import json\n"
+    "import numpy as np\n"
+    "import os\n"
+    "import pandas as pd\n"
+    "import pyarrow as pa\n"
+    "import re\n"
+    "import struct\n"
+    "\n"
+    "class _PgPandasFrames(dict):\n"
+    "    # Read-only views over the Arrow copies published in shared memory: the\n"
+    "    # base copy of a frame and the rows changed since, which are merged the\n"
+    "    # first time the frame is read.  A view is rebuilt only when another\n"
+    "    # version has been published, and the base view is kept when only the\n"
+    "    # changes were.  Every column is backed by pd.ArrowDtype, so strings\n"
+    "    # and columns with nulls wrap the shared buffers without copying too.\n"
+    "    def _parts(self, name):\n"
+    "        version = _pg_pandas.frame_version(name)\n"
+    "        if version is None:\n"
+    "            dict.pop(self, name, None)\n"
+    "            return None\n"
+    "        cached = dict.get(self, name)\n"
+    "        if cached is None or cached['version'] != version:\n"
+    "            attached = _pg_pandas.attach_frame(name)\n"
+    "            if attached is None:\n"
+    "                dict.pop(self, name, None)\n"
+    "                return None\n"
+    "            version, base_version, base, delta = attached\n"
+    "            if cached is None or cached['base_version'] != base_version:\n"
+    "                cached = {'base_version': base_version, 'base': _pg_pandas_view(base)}\n"
+    "            cached = dict(cached, version=version, df=None,\n"
+    "                          delta=None if delta is None else _pg_pandas_view(delta))\n"
+    "            dict.__setitem__(self, name, cached)\n"
+    "            _pg_pandas.advertise_frame(name)\n"
+    "        return cached\n"
+    "\n"
+    "    def __getitem__(self, name):\n"
+    "        cached = self._parts(name)\n"
+    "        if cached is None:\n"
+    "            raise KeyError(name)\n"
+    "        if cached['df'] is None:\n"
+    "            cached['df'] = _pg_pandas_merge(cached['base'], cached['delta'])\n"
+    "        return cached['df']\n"
+    "\n"
+    "    def __contains__(self, name):\n"
+    "        return _pg_pandas.frame_version(name) is not None\n"
+    "\n"
+    "    def get(self, name, default=None):\n"
+    "        try:\n"
+    "            return self[name]\n"
+    "        except KeyError:\n"
+    "            return default\n"
+    "\n"
+    "_PG_PANDAS_DELETED = '__pg_pandas_deleted'\n"
+    "\n"
+    "def _pg_pandas_view(segment):\n"
+    "    table = pa.ipc.open_stream(pa.py_buffer(memoryview(segment))).read_all()\n"
+    "    return table.to_pandas(types_mapper=pd.ArrowDtype)\n"
+    "\n"
+    "def _pg_pandas_merge(base, delta):\n"
+    "    # The base copy with the changed rows replaced and the deleted ones gone\n"
+    "    if delta is None or not len(delta):\n"
+    "        return base\n"
+    "    deleted = delta[_PG_PANDAS_DELETED].to_numpy(dtype=bool)\n"
+    "    changed = delta[~deleted].drop(columns=_PG_PANDAS_DELETED)\n"
+    "    return pd.concat([base.drop(index=delta.index, errors='ignore'),\n"
+    "                      changed.astype(base.dtypes.to_dict(), errors='ignore')])\n"
+    "\n"
+    "frames = _PgPandasFrames()\n"
+    "_pg_pandas_owned = {}\n"
+    "_pg_pandas_meta = {}\n"
+    "_pg_pandas_persisted = {}\n"
+    "_pg_pandas_subscriptions = {}\n"
+    "_pg_pandas_cache_dir = None\n"
+    "_pg_pandas_operations = {}\n"
+    "\n"
+    "def _pg_pandas_globals():\n"
+    "    # What an operation sees: the allowed modules, the cached frames and\n"
+    "    # the restricted builtins.  Library code it calls has its own globals.\n"
+    "    return {'__builtins__': _pg_pandas_builtins, 'pd': pd, 'np': np, 'pa': pa, 'json': json,\n"
+    "            'frames': frames, '_pg_pandas_additive_delta': _pg_pandas_additive_delta,\n"
+    "            '_pg_pandas_additive_rows': _pg_pandas_additive_rows}\n"
+    "\n"
+    "def _pg_pandas_operation(source):\n"
+    "    # Compiled operations, at most as many as a worker advertises\n"
+    "    # (PANDAS_ADVERTISED_OPERATIONS); the oldest is evicted first.\n"
+    "    operation = _pg_pandas_operations.get(source)\n"
+    "    if operation is None:\n"
+    "        if len(_pg_pandas_operations) >= 64:\n"
+    "            _pg_pandas_operations.pop(next(iter(_pg_pandas_operations)))\n"
+    "        operation = eval(compile(source, '<operation>', 'eval'), _pg_pandas_globals())\n"
+    "        _pg_pandas_operations[source] = operation\n"
+    "    return operation\n"
+    "_PG_PANDAS_UNCHANGED = object()\n"
+    "_PG_PANDAS_TD_HEADER = re.compile(r'^table (.+?): (INSERT|UPDATE|DELETE|TRUNCATE): ?(.*)$', re.S)\n"
+    "_PG_PANDAS_TD_COLUMN = re.compile(r'(\"(?:[^\"]|\"\")+\"|[^\\[\\s]+)\\[(.+?)\\]:(\\'(?:[^\\']|\\'\\')*\\'|\\S+)')\n"
+    "\n"
+    "def _pg_pandas_literal(value):\n"
+    "    if value is None:\n"
+    "        return 'NULL'\n"
+    "    if isinstance(value, bool):\n"
+    "        return 'true' if value else 'false'\n"
+    "    if isinstance(value, (int, float)):\n"
+    "        return repr(value)\n"
+    "    return \"E'%s'\" % str(value).replace('\\\\', '\\\\\\\\').replace(\"'\", \"''\")\n"
+    "\n"
+    "def _pg_pandas_timestamp(value):\n"
+    "    try:\n"
+    "        return pd.Timestamp(value)\n"
+    "    except ValueError:\n"
+    "        return value\n"
+    "\n"
+    "# Text values of the types psycopg2 would not return as str\n"
+    "_PG_PANDAS_SPI_TYPES = {16: lambda v: v == 't', 20: int, 21: int, 23: int, 26: int,\n"
+    "                        700: float, 701: float, 1700: float, 114: json.loads, 3802: json.loads,\n"
+    "                        1082: _pg_pandas_timestamp, 1114: _pg_pandas_timestamp,\n"
+    "                        1184: _pg_pandas_timestamp}\n"
+    "\n"
+    "class _PgPandasSpiCursor:\n"
+    "    # The part of a DB-API cursor the loaders use, over _pg_pandas.execute.\n"
+    "    # Parameters are interpolated as literals, as psycopg2 does.\n"
+    "    def __init__(self):\n"
+    "        self.description = None\n"
+    "        self._rows = []\n"
+    "\n"
+    "    def execute(self, query, params=None):\n"
+    "        if params is not None:\n"
+    "            query = query % tuple(_pg_pandas_literal(p) for p in params)\n"
+    "        names, types, rows = _pg_pandas.execute(query)\n"
+    "        self.description = [(n, t, None, None, None, None, None) for n, t in zip(names, types)]\n"
+    "        convert = [_PG_PANDAS_SPI_TYPES.get(t) for t in types]\n"
+    "        self._rows = [tuple(v if v is None or f is None else f(v) for v, f in zip(row, convert))\n"
+    "                      for row in rows]\n"
+    "\n"
+    "    def fetchall(self):\n"
+    "        rows, self._rows = self._rows, []\n"
+    "        return rows\n"
+    "\n"
+    "    def fetchone(self):\n"
+    "        return self._rows.pop(0) if self._rows else None\n"
+    "\n"
+    "class _PgPandasSpiConnection:\n"
+    "    def cursor(self):\n"
+    "        return _PgPandasSpiCursor()\n"
+    "\n"
+    "    def close(self):\n"
+    "        pass\n"
+    "\n"
+    "def _pg_pandas_connect():\n"
+    "    # Pool workers are connected to their database and query it through\n"
+    "    # SPI.  The others open a libpq connection, configured by PGHOST,\n"
+    "    # PGPORT, PGUSER and PGPASSWORD.\n"
+    "    if _pg_pandas.connected():\n"
+    "        return _PgPandasSpiConnection()\n"
+    "    import psycopg2\n"
+    "    conn = psycopg2.connect(dbname=os.environ.get('PGDATABASE', 'postgres'),\n"
+    "                            user=os.environ.get('PGUSER', 'postgres'),\n"
+    "                            password=os.environ.get('PGPASSWORD', ''),\n"
+    "                            host=os.environ.get('PGHOST', 'localhost'),\n"
+    "                            port=os.environ.get('PGPORT', '5432'))\n"
+    "    conn.autocommit = True\n"
+    "    return conn\n"
+    "\n"
+    "def _pg_pandas_query_frame(conn, query):\n"
+    "    cur = conn.cursor()\n"
+    "    cur.execute(query)\n"
+    "    return pd.DataFrame.from_records(cur.fetchall(), columns=[d[0] for d in cur.description],\n"
+    "                                     coerce_float=True)\n"
+    "\n"
+    "def _pg_pandas_additive_rows(operation, df, keys):\n"
+    "    # operation(df) with the number of source rows per key, which decides\n"
+    "    # when a group of an additive view is gone\n"
+    "    return operation(df).join(df.groupby(keys).size().rename('__pg_pandas_rows'), on=keys)\n"
+    "\n"
+    "def _pg_pandas_additive_delta(operation, df, keys):\n"
+    "    # Change in an additive result (sums, counts) for a batch of logged\n"
+    "    # changes: operation(inserted rows) - operation(deleted rows) per key,\n"
+    "    # with the change in the number of source rows per key.\n"
+    "    sign = df.pop('__pg_pandas_sign')\n"
+    "    parts = []\n"
+    "    for s in (1, -1):\n"
+    "        rows = df[sign == s].reset_index(drop=True)\n"
+    "        if len(rows):\n"
+    "            part = operation(rows).set_index(keys).select_dtypes('number')\n"
+    "            part['__pg_pandas_rows'] = rows.groupby(keys).size()\n"
+    "            parts.append(part * s)\n"
+    "    if not parts:\n"
+    "        return pd.DataFrame(columns=keys)\n"
+    "    return pd.concat(parts).groupby(level=keys).sum().reset_index()\n"
+    "\n"
+    "def _pg_pandas_td_columns(text):\n"
+    "    values = {}\n"
+    "    for name, _type, value in _PG_PANDAS_TD_COLUMN.findall(text):\n"
+    "        if name.startswith('\"'):\n"
+    "            name = name[1:-1].replace('\"\"', '\"')\n"
+    "        if value == 'null':\n"
+    "            value = None\n"
+    "        elif value == 'unchanged-toast-datum':\n"
+    "            value = _PG_PANDAS_UNCHANGED\n"
+    "        elif value.startswith(\"'\"):\n"
+    "            value = value[1:-1].replace(\"''\", \"'\")\n"
+    "        values[name] = value\n"
+    "    return values\n"
+    "\n"
+    "def _pg_pandas_td_changes(sub, rows):\n"
+    "    for (data,) in rows:\n"
+    "        match = _PG_PANDAS_TD_HEADER.match(data)\n"
+    "        if match is None or match.group(1) != sub['relation']:\n"
+    "            continue\n"
+    "        action, rest = match.group(2), match.group(3)\n"
+    "        if action == 'TRUNCATE':\n"
+    "            yield 'T', None, None\n"
+    "        elif action == 'DELETE':\n"
+    "            if not rest.startswith('(no-tuple-data)'):\n"
+    "                yield 'D', _pg_pandas_td_columns(rest), None\n"
+    "        elif rest.startswith('old-key:'):\n"
+    "            old, new = rest[len('old-key:'):].split(' new-tuple:', 1)\n"
+    "            yield action[0], _pg_pandas_td_columns(old), _pg_pandas_td_columns(new)\n"
+    "        else:\n"
+    "            yield action[0], None, _pg_pandas_td_columns(rest)\n"
+    "\n"
+    "def _pg_pandas_po_string(buf, pos):\n"
+    "    end = buf.index(b'\\0', pos)\n"
+    "    return buf[pos:end].decode(), end + 1\n"
+    "\n"
+    "def _pg_pandas_po_tuple(buf, pos, names):\n"
+    "    (ncols,) = struct.unpack_from('!h', buf, pos)\n"
+    "    pos += 2\n"
+    "    values = {}\n"
+    "    for i in range(ncols):\n"
+    "        kind = buf[pos:pos + 1]\n"
+    "        pos += 1\n"
+    "        if kind == b't':\n"
+    "            (length,) = struct.unpack_from('!i', buf, pos)\n"
+    "            pos += 4\n"
+    "            values[names[i]] = buf[pos:pos + length].decode()\n"
+    "            pos += length\n"
+    "        elif kind == b'n':\n"
+    "            values[names[i]] = None\n"
+    "        else:\n"
+    "            values[names[i]] = _PG_PANDAS_UNCHANGED\n"
+    "    return values, pos\n"
+    "\n"
+    "def _pg_pandas_po_changes(sub, rows):\n"
+    "    for (data,) in rows:\n"
+    "        buf = bytes(data)\n"
+    "        kind = buf[:1]\n"
+    "        if kind == b'R':\n"
+    "            (relid,) = struct.unpack_from('!I', buf, 1)\n"
+    "            _nspname, pos = _pg_pandas_po_string(buf, 5)\n"
+    "            _relname, pos = _pg_pandas_po_string(buf, pos)\n"
+    "            (ncols,) = struct.unpack_from('!h', buf, pos + 1)\n"
+    "            pos += 3\n"
+    "            names = []\n"
+    "            for _ in range(ncols):\n"
+    "                name, pos = _pg_pandas_po_string(buf, pos + 1)\n"
+    "                names.append(name)\n"
+    "                pos += 8\n"
+    "            sub['columns'][relid] = names\n"
+    "            continue\n"
+    "        if kind not in (b'I', b'U', b'D', b'T'):\n"
+    "            continue\n"
+    "        if kind == b'T':\n"
+    "            (nrels,) = struct.unpack_from('!i', buf, 1)\n"
+    "            relids = struct.unpack_from('!%dI' % nrels, buf, 6)\n"
+    "            if sub['relid'] in relids:\n"
+    "                yield 'T', None, None\n"
+    "            continue\n"
+    "        (relid,) = struct.unpack_from('!I', buf, 1)\n"
+    "        if relid != sub['relid']:\n"
+    "            continue\n"
+    "        names = sub['columns'][relid]\n"
+    "        old = None\n"
+    "        pos = 5\n"
+    "        if buf[pos:pos + 1] in (b'K', b'O'):\n"
+    "            old, pos = _pg_pandas_po_tuple(buf, pos + 1, names)\n"
+    "        if kind == b'D':\n"
+    "            yield 'D', old, None\n"
+    "        else:\n"
+    "            new, pos = _pg_pandas_po_tuple(buf, pos + 1, names)\n"
+    "            yield kind.decode(), old, new\n"
+    "\n"
+    "def _pg_pandas_convert(df, column, value):\n"
+    "    if value is None or column not in df.columns:\n"
+    "        return value\n"
+    "    kind = df.dtypes[column].kind\n"
+    "    if kind in 'iu':\n"
+    "        return int(value)\n"
+    "    if kind == 'f':\n"
+    "        return float(value)\n"
+    "    if kind == 'b':\n"
+    "        return value in ('t', 'true')\n"
+    "    if kind == 'M':\n"
+    "        return pd.Timestamp(value)\n"
+    "    return value\n"
+    "\n"
+    "def _pg_pandas_slot_changes(sub, conn, function, limit):\n"
+    "    cur = conn.cursor()\n"
+    "    if sub['plugin'] == 'pgoutput':\n"
+    "        cur.execute(\"SELECT data FROM pg_logical_slot_%s_binary_changes(%%s, NULL, %%s, \"\n"
+    "                    \"'proto_version', '1', 'publication_names', %%s)\" % function,\n"
+    "                    (sub['slot'], limit, sub['publication']))\n"
+    "    else:\n"
+    "        cur.execute(\"SELECT data FROM pg_logical_slot_%s_changes(%%s, NULL, %%s)\" % function,\n"
+    "                    (sub['slot'], limit))\n"
+    "    return cur.fetchall()\n"
+    "\n"
+    "def _pg_pandas_fetch(sub, conn):\n"
+    "    # Peek only: the changes stay in the slot until _pg_pandas_consume, so a\n"
+    "    # failed apply does not lose them.\n"
+    "    rows = _pg_pandas_slot_changes(sub, conn, 'peek', None)\n"
+    "    if sub['plugin'] == 'pgoutput':\n"
+    "        return rows, _pg_pandas_po_changes(sub, rows)\n"
+    "    return rows, _pg_pandas_td_changes(sub, rows)\n"
+    "\n"
+    "def _pg_pandas_consume(sub, conn, nrows):\n"
+    "    # Decoding only emits whole committed transactions and stops at the\n"
+    "    # first transaction boundary past nrows, so this consumes exactly what\n"
+    "    # was peeked even if more has been committed since.\n"
+    "    if nrows:\n"
+    "        _pg_pandas_slot_changes(sub, conn, 'get', nrows)\n"
+    "\n"
+    "def _pg_pandas_counters(conn, relid):\n"
+    "    # Taken before reading the data they describe, so a frame never looks\n"
+    "    # newer than it is.  Stats are reset by a crash, which forces a reload.\n"
+    "    cur = conn.cursor()\n"
+    "    cur.execute('SELECT pg_relation_filenode(relid), n_tup_ins, n_tup_upd, n_tup_del '\n"
+    "                'FROM pg_stat_all_tables WHERE relid = %s', (relid,))\n"
+    "    return list(cur.fetchone() or [])\n"
+    "\n"
+    "def _pg_pandas_stream(df):\n"
+    "    sink = pa.BufferOutputStream()\n"
+    "    table = pa.Table.from_pandas(df)\n"
+    "    with pa.ipc.new_stream(sink, table.schema) as writer:\n"
+    "        writer.write_table(table)\n"
+    "    return sink.getvalue()\n"
+    "\n"
+    "def _pg_pandas_publish(name, df):\n"
+    "    # The owner keeps no private copy; it reads its frame through frames[]\n"
+    "    _pg_pandas_owned[name] = _pg_pandas.publish_frame(name, _pg_pandas_stream(df))\n"
+    "    _pg_pandas.advertise_frame(name)\n"
+    "\n"
+    "def _pg_pandas_rows(like, entries):\n"
+    "    # A frame shaped like another one from (key, row, deleted) entries\n"
+    "    rows = pd.DataFrame([row for _, row, _ in entries],\n"
+    "                        index=pd.Index([k for k, _, _ in entries], name=like.index.name),\n"
+    "                        columns=like.columns, dtype=object)\n"
+    "    rows = rows.astype(like.dtypes.to_dict(), errors='ignore')\n"
+    "    rows[_PG_PANDAS_DELETED] = pd.array([d for _, _, d in entries], dtype=pd.ArrowDtype(pa.bool_()))\n"
+    "    return rows\n"
+    "\n"
+    "def _pg_pandas_current(base, delta, k):\n"
+    "    # The row a key stands for now, as a dict, or None if there is none\n"
+    "    if delta is not None and k in delta.index:\n"
+    "        row = delta.loc[k]\n"
+    "        return None if row[_PG_PANDAS_DELETED] else row.drop(_PG_PANDAS_DELETED).to_dict()\n"
+    "    if k in base.index:\n"
+    "        return base.loc[k].to_dict()\n"
+    "    return None\n"
+    "\n"
+    "def _pg_pandas_apply(name, changes):\n"
+    "    # Collapse the change stream to its final state per key.  Replaying an\n"
+    "    # upsert or a delete twice is harmless, which lets a load race with\n"
+    "    # changes that are still sitting in the slot.\n"
+    "    sub = _pg_pandas_subscriptions[name]\n"
+    "    parts = frames._parts(name)\n"
+    "    if parts is None or parts['version'] != _pg_pandas_owned[name]:\n"
+    "        # Dropped or reloaded through another worker\n"
+    "        _pg_pandas_owned.pop(name, None)\n"
+    "        _pg_pandas_subscriptions.pop(name, None)\n"
+    "        return 0\n"
+    "    base, delta = parts['base'], parts['delta']\n"
+    "    key = sub['key']\n"
+    "    pending = {}\n"
+    "    truncated = False\n"
+    "    count = 0\n"
+    "    for action, old, new in changes:\n"
+    "        count += 1\n"
+    "        if action == 'T':\n"
+    "            pending.clear()\n"
+    "            truncated = True\n"
+    "            continue\n"
+    "        if old is not None and old.get(key) is not None:\n"
+    "            old_key = _pg_pandas_convert(base, key, old[key])\n"
+    "            if action == 'D' or new.get(key) != old[key]:\n"
+    "                pending[old_key] = None\n"
+    "        if new is not None:\n"
+    "            new_key = _pg_pandas_convert(base, key, new[key])\n"
+    "            row = pending.get(new_key) or {}\n"
+    "            row.update((c, _pg_pandas_convert(base, c, v)) for c, v in new.items()\n"
+    "                       if v is not _PG_PANDAS_UNCHANGED)\n"
+    "            pending[new_key] = row\n"
+    "    if count == 0:\n"
+    "        return 0\n"
+    "    if truncated:\n"
+    "        rows = _pg_pandas_rows(base, [(k, row, False) for k, row in pending.items() if row is not None])\n"
+    "        _pg_pandas_publish(name, rows.drop(columns=_PG_PANDAS_DELETED))\n"
+    "        return count\n"
+    "    # Only the changed rows are published.  Updated rows are merged with\n"
+    "    # their old values; deleted rows of the base copy are marked deleted.\n"
+    "    entries = []\n"
+    "    for k, row in pending.items():\n"
+    "        if row is not None:\n"
+    "            old = _pg_pandas_current(base, delta, k)\n"
+    "            entries.append((k, row if old is None else dict(old, **row), False))\n"
+    "        elif k in base.index:\n"
+    "            entries.append((k, {key: k}, True))\n"
+    "    changed = _pg_pandas_rows(base, entries)\n"
+    "    if delta is not None:\n"
+    "        changed = pd.concat([delta.drop(index=list(pending), errors='ignore'), changed])\n"
+    "    # Folding the changes into a new base copy costs the whole frame, so it\n"
+    "    # waits until they reach an eighth of it, which keeps the cost per\n"
+    "    # changed row constant.\n"
+    "    if len(changed) > max(1024, len(base) // 8):\n"
+    "        _pg_pandas_publish(name, _pg_pandas_merge(base, changed))\n"
+    "        return count\n"
+    "    version = _pg_pandas.publish_delta(name, _pg_pandas_stream(changed))\n"
+    "    if version is None:\n"
+    "        _pg_pandas_owned.pop(name, None)\n"
+    "        _pg_pandas_subscriptions.pop(name, None)\n"
+    "        return 0\n"
+    "    _pg_pandas_owned[name] = version\n"
+    "    _pg_pandas.advertise_frame(name)\n"
+    "    return count\n"
+    "\n"
+    "def _pg_pandas_subscribe(conn, name, meta):\n"
+    "    cur = conn.cursor()\n"
+    "    cur.execute('SELECT plugin FROM pg_replication_slots WHERE slot_name = %s', (meta['slot'],))\n"
+    "    found = cur.fetchone()\n"
+    "    if found is None or found[0] not in ('test_decoding', 'pgoutput'):\n"
+    "        raise ValueError('slot %s must exist and use test_decoding or pgoutput' % meta['slot'])\n"
+    "    if found[0] == 'pgoutput' and not meta['publication']:\n"
+    "        raise ValueError('slot %s uses pgoutput and needs a publication' % meta['slot'])\n"
+    "    sub = {'slot': meta['slot'], 'plugin': found[0], 'publication': meta['publication'],\n"
+    "           'relation': meta['relation'], 'relid': meta['relid'], 'key': meta['key'],\n"
+    "           'columns': {}}\n"
+    "    _pg_pandas_subscriptions[name] = sub\n"
+    "    return sub\n"
+    "\n"
+    "def _pg_pandas_cache_load(name, relation, relid, key, slot, publication):\n"
+    "    _pg_pandas_cache_drop(name)\n"
+    "    meta = {'relation': relation, 'relid': relid, 'key': key, 'slot': slot,\n"
+    "            'publication': publication}\n"
+    "    conn = _pg_pandas_connect()\n"
+    "    try:\n"
+    "        if slot:\n"
+    "            sub = _pg_pandas_subscribe(conn, name, meta)\n"
+    "            # Consume what is already queued; the load below covers it.\n"
+    "            _pg_pandas_slot_changes(sub, conn, 'get', None)\n"
+    "        meta['counters'] = _pg_pandas_counters(conn, relid)\n"
+    "        _pg_pandas_meta[name] = meta\n"
+    "        _pg_pandas_publish(name, _pg_pandas_query_frame(conn, 'SELECT * FROM %s' % relation).set_index(key, drop=False))\n"
+    "    except Exception:\n"
+    "        _pg_pandas_meta.pop(name, None)\n"
+    "        _pg_pandas_subscriptions.pop(name, None)\n"
+    "        raise\n"
+    "    finally:\n"
+    "        conn.close()\n"
+    "\n"
+    "def _pg_pandas_cache_reload(name):\n"
+    "    # Invalidate a frame whose changes could not be applied and load it\n"
+    "    # again from SQL; the load also consumes what the slot still holds.\n"
+    "    meta = _pg_pandas_meta.get(name)\n"
+    "    if meta is None:\n"
+    "        _pg_pandas_subscriptions.pop(name, None)\n"
+    "        return\n"
+    "    try:\n"
+    "        _pg_pandas_cache_load(name, meta['relation'], meta['relid'], meta['key'],\n"
+    "                              meta['slot'], meta['publication'])\n"
+    "    except Exception as e:\n"
+    "        print('pg_pandas: reloading cached frame %s failed: %s' % (name, e))\n"
+    "\n"
+    "def _pg_pandas_cache_path(name, suffix):\n"
+    "    return os.path.join(_pg_pandas_cache_dir, name.encode().hex() + suffix)\n"
+    "\n"
+    "def _pg_pandas_cache_drop(name):\n"
+    "    _pg_pandas.drop_frame(name)\n"
+    "    dict.pop(frames, name, None)\n"
+    "    _pg_pandas_owned.pop(name, None)\n"
+    "    _pg_pandas_meta.pop(name, None)\n"
+    "    _pg_pandas_persisted.pop(name, None)\n"
+    "    _pg_pandas_subscriptions.pop(name, None)\n"
+    "    if _pg_pandas_cache_dir is not None:\n"
+    "        for suffix in ('.arrows', '.delta.arrows', '.json'):\n"
+    "            try:\n"
+    "                os.unlink(_pg_pandas_cache_path(name, suffix))\n"
+    "            except FileNotFoundError:\n"
+    "                pass\n"
+    "\n"
+    "def _pg_pandas_write_file(path, data):\n"
+    "    with open(path + '.tmp', 'wb') as f:\n"
+    "        f.write(data)\n"
+    "        f.flush()\n"
+    "        os.fsync(f.fileno())\n"
+    "    os.replace(path + '.tmp', path)\n"
+    "\n"
+    "def _pg_pandas_cache_persist():\n"
+    "    # Write every owned frame that changed since it was last written.  The\n"
+    "    # Arrow streams are copied straight out of the shared segments, and the\n"
+    "    # base copy only when it was replaced.\n"
+    "    if _pg_pandas_cache_dir is None:\n"
+    "        return\n"
+    "    for name, version in list(_pg_pandas_owned.items()):\n"
+    "        persisted = _pg_pandas_persisted.get(name)\n"
+    "        if (persisted is not None and persisted[1] == version) or name not in _pg_pandas_meta:\n"
+    "            continue\n"
+    "        attached = _pg_pandas.attach_frame(name)\n"
+    "        if attached is None or attached[0] != version:\n"
+    "            continue\n"
+    "        _version, base_version, base, delta = attached\n"
+    "        delta_path = _pg_pandas_cache_path(name, '.delta.arrows')\n"
+    "        try:\n"
+    "            if persisted is None or persisted[0] != base_version:\n"
+    "                # Old changes must never be applied to a newer base copy\n"
+    "                if os.path.exists(delta_path):\n"
+    "                    os.unlink(delta_path)\n"
+    "                _pg_pandas_write_file(_pg_pandas_cache_path(name, '.arrows'), memoryview(base))\n"
+    "            if delta is not None:\n"
+    "                _pg_pandas_write_file(delta_path, memoryview(delta))\n"
+    "            meta = dict(_pg_pandas_meta[name], name=name)\n"
+    "            _pg_pandas_write_file(_pg_pandas_cache_path(name, '.json'), json.dumps(meta).encode())\n"
+    "            _pg_pandas_persisted[name] = (base_version, version)\n"
+    "        except Exception as e:\n"
+    "            print('pg_pandas: persisting cached frame %s failed: %s' % (name, e))\n"
+    "\n"
+    "def _pg_pandas_cache_directory(directory):\n"
+    "    # Where this worker writes the frames it owns\n"
+    "    global _pg_pandas_cache_dir\n"
+    "    _pg_pandas_cache_dir = directory\n"
+    "    os.makedirs(directory, exist_ok=True)\n"
+    "\n"
+    "def _pg_pandas_cache_restore(directory, trust_counters):\n"
+    "    # Reuse frames written before a restart when the source relation has\n"
+    "    # not changed since; anything else is reloaded from SQL.  A standby\n"
+    "    # does not count replayed changes, so there every frame is reloaded.\n"
+    "    _pg_pandas_cache_directory(directory)\n"
+    "    conn = None\n"
+    "    try:\n"
+    "        for entry in sorted(os.listdir(directory)):\n"
+    "            if not entry.endswith('.json'):\n"
+    "                continue\n"
+    "            try:\n"
+    "                with open(os.path.join(directory, entry)) as f:\n"
+    "                    meta = json.load(f)\n"
+    "                name = meta.pop('name')\n"
+    "                if _pg_pandas.frame_version(name) is not None:\n"
+    "                    continue\n"
+    "                if conn is None:\n"
+    "                    conn = _pg_pandas_connect()\n"
+    "                if not trust_counters or _pg_pandas_counters(conn, meta['relid']) != meta['counters']:\n"
+    "                    _pg_pandas_cache_load(name, meta['relation'], meta['relid'], meta['key'],\n"
+    "                                          meta['slot'], meta['publication'])\n"
+    "                    continue\n"
+    "                buf = pa.memory_map(_pg_pandas_cache_path(name, '.arrows')).read_buffer()\n"
+    "                base_version = version = _pg_pandas.publish_frame(name, buf)\n"
+    "                delta_path = _pg_pandas_cache_path(name, '.delta.arrows')\n"
+    "                if os.path.exists(delta_path):\n"
+    "                    version = _pg_pandas.publish_delta(name, pa.memory_map(delta_path).read_buffer())\n"
+    "                _pg_pandas_owned[name] = version\n"
+    "                _pg_pandas.advertise_frame(name)\n"
+    "                _pg_pandas_meta[name] = meta\n"
+    "                _pg_pandas_persisted[name] = (base_version, version)\n"
+    "                if meta['slot']:\n"
+    "                    _pg_pandas_subscribe(conn, name, meta)\n"
+    "            except Exception as e:\n"
+    "                print('pg_pandas: restoring cached frame from %s failed: %s' % (entry, e))\n"
+    "    finally:\n"
+    "        if conn is not None:\n"
+    "            conn.close()\n"
+    "\n"
+    "def _pg_pandas_cache_release(path):\n"
+    "    # Hand the frames this worker owns to the next process in its slot.\n"
+    "    # They are persisted as at shutdown and listed with their versions;\n"
+    "    # the next process adopts those that were not replaced meanwhile.\n"
+    "    _pg_pandas_cache_persist()\n"
+    "    owned = [{'name': name, 'version': version, 'meta': _pg_pandas_meta.get(name)}\n"
+    "             for name, version in _pg_pandas_owned.items()]\n"
+    "    _pg_pandas_write_file(path, json.dumps(owned).encode())\n"
+    "    _pg_pandas_owned.clear()\n"
+    "    _pg_pandas_subscriptions.clear()\n"
+    "\n"
+    "def _pg_pandas_cache_adopt(path):\n"
+    "    try:\n"
+    "        with open(path) as f:\n"
+    "            owned = json.load(f)\n"
+    "    except FileNotFoundError:\n"
+    "        return\n"
+    "    os.unlink(path)\n"
+    "    conn = None\n"
+    "    try:\n"
+    "        for entry in owned:\n"
+    "            name, meta = entry['name'], entry['meta']\n"
+    "            try:\n"
+    "                attached = _pg_pandas.attach_frame(name)\n"
+    "                if meta is None or attached is None or attached[0] != entry['version']:\n"
+    "                    continue\n"
+    "                _pg_pandas_owned[name] = attached[0]\n"
+    "                _pg_pandas.advertise_frame(name)\n"
+    "                _pg_pandas_meta[name] = meta\n"
+    "                _pg_pandas_persisted[name] = (attached[1], attached[0])\n"
+    "                if meta['slot']:\n"
+    "                    if conn is None:\n"
+    "                        conn = _pg_pandas_connect()\n"
+    "                    _pg_pandas_subscribe(conn, name, meta)\n"
+    "            except Exception as e:\n"
+    "                print('pg_pandas: adopting cached frame %s failed: %s' % (name, e))\n"
+    "    finally:\n"
+    "        if conn is not None:\n"
+    "            conn.close()\n"
+    "\n"
+    "def _pg_pandas_cache_refresh():\n"
+    "    if not _pg_pandas_subscriptions:\n"
+    "        return\n"
+    "    conn = _pg_pandas_connect()\n"
+    "    try:\n"
+    "        for name, sub in list(_pg_pandas_subscriptions.items()):\n"
+    "            try:\n"
+    "                counters = _pg_pandas_counters(conn, sub['relid'])\n"
+    "                rows, changes = _pg_pandas_fetch(sub, conn)\n"
+    "                applied = _pg_pandas_apply(name, changes)\n"
+    "                if name not in _pg_pandas_subscriptions:\n"
+    "                    # Dropped or taken over by another worker; leave the slot\n"
+    "                    # to whoever owns the frame now.\n"
+    "                    continue\n"
+    "                _pg_pandas_consume(sub, conn, len(rows))\n"
+    "                if applied and name in _pg_pandas_meta:\n"
+    "                    _pg_pandas_meta[name]['counters'] = counters\n"
+    "            except Exception as e:\n"
+    "                print('pg_pandas: refreshing cached frame %s failed: %s' % (name, e))\n"
+    "                _pg_pandas_cache_reload(name)\n"
+    "    finally:\n"
+    "        conn.close()\n";
+
+/*
+ * Report the pending Python exception.  It is always printed to the log;
+ * when error is given, its text is also copied there for the caller.
+ */
+static void
+report_python_error(char *error, Size len)
+{
+    if (error != NULL)
+    {
+        PyObject *type, *value, *traceback;
+        PyObject *text;
+
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        text = value != NULL ? PyObject_Str(value) : NULL;
+        strlcpy(error, text != NULL && PyUnicode_AsUTF8(text) ? PyUnicode_AsUTF8(text)
+                : "Error executing Python code.", len);
+        Py_XDECREF(text);
+        PyErr_Restore(type, value, traceback);
+    }
+    PyErr_Print();
+}
+
+/* Call one of the helpers defined by cache_python_source; steals args */
+static bool
+call_cache_helper(const char *function, PyObject *args, char *error, Size len)
+{
+    PyObject *pModule = PyImport_AddModule("__main__");
+    PyObject *pFunc = PyObject_GetAttrString(pModule, function);
+    PyObject *pValue = NULL;
+
+    if (pFunc != NULL && args != NULL)
+        pValue = PyObject_CallObject(pFunc, args);
+
+    Py_XDECREF(pFunc);
+    Py_XDECREF(args);
+
+    if (pValue == NULL)
+    {
+        report_python_error(error, len);
+        return false;
+    }
+
+    Py_DECREF(pValue);
+    return true;
+}
+
+/*
+ * Replace the result of a task.  Returns false, after storing a short
+ * error instead, if the text does not fit in shared memory.
+ */
+static bool
+set_task_result(PandasTask *task, const char *text, Size len)
+{
+    static const char too_large[] = "result does not fit in pg_pandas payload memory";
+
+    payload_free(pandas_shared, &task->result);
+    if (payload_store(pandas_shared, &task->result, text, len))
+        return true;
+
+    ereport(LOG, (errmsg("Result of %zu bytes does not fit in payload memory.", len)));
+    (void) payload_store(pandas_shared, &task->result, too_large, sizeof(too_large) - 1);
+    return false;
+}
+
+/* Load or drop a cached frame as requested by pg_pandas_cache_table/drop */
+static bool
+process_cache_command(PandasTask *task)
+{
+    bool ok;
+    char error[1024];
+
+    if (task->command == PANDAS_CMD_CACHE_DROP)
+    {
+        ok = call_cache_helper("_pg_pandas_cache_drop",
+                               Py_BuildValue("(s)", task->frame_name),
+                               error, sizeof(error));
+    }
+    else
+    {
+        dsm_segment *seg;
+        const char *relation = payload_data(pandas_shared, &task->data, &seg);
+        PyObject *args = Py_BuildValue("(ssIszz)",
+                                       task->frame_name,
+                                       relation,
+                                       (unsigned int) task->relid,
+                                       task->key_column,
+                                       task->slot_name[0] ? task->slot_name : NULL,
+                                       task->publication[0] ? task->publication : NULL);
+
+        if (seg != NULL)
+            dsm_detach(seg);
+        ok = call_cache_helper("_pg_pandas_cache_load", args, error, sizeof(error));
+    }
+
+    if (!ok)
+    {
+        ereport(LOG, (errmsg("Error processing cached frame \"%s\".", task->frame_name)));
+        set_task_result(task, error, strlen(error));
+    }
+    return ok;
+}
+
+/* Apply pending logical decoding changes to every subscribed frame */
+static void
+refresh_cached_frames(void)
+{
+    if (!call_cache_helper("_pg_pandas_cache_refresh", PyTuple_New(0), NULL, 0))
+        ereport(LOG, (errmsg("Error refreshing cached frames.")));
+}
+
+/* Write changed cached frames under PGDATA so a restart can reuse them */
+static void
+persist_cached_frames(void)
+{
+    if (!call_cache_helper("_pg_pandas_cache_persist", PyTuple_New(0), NULL, 0))
+        ereport(LOG, (errmsg("Error persisting cached frames.")));
+}
+
+/* Directory of this worker's pool under PGDATA/pg_pandas */
+static void
+cache_directory(char *path)
+{
+    if (OidIsValid(frames_database))
+        snprintf(path, MAXPGPATH, "%s/%s/%u", DataDir, PG_PANDAS_CACHE_DIR, frames_database);
+    else
+        snprintf(path, MAXPGPATH, "%s/%s", DataDir, PG_PANDAS_CACHE_DIR);
+}
+
+/*
+ * Set where this worker persists the frames it owns, one directory per
+ * pool, and reuse the frames persisted there before the last shutdown.
+ * Only the first worker of a pool restores them.  During recovery the
+ * statistics that prove a frame current are not maintained, so the frames
+ * are reloaded instead.
+ */
+static void
+restore_cached_frames(bool restore)
+{
+    char path[MAXPGPATH];
+    PyObject *args;
+
+    cache_directory(path);
+    if (restore)
+        args = Py_BuildValue("(sO)", path, RecoveryInProgress() ? Py_False : Py_True);
+    else
+        args = Py_BuildValue("(s)", path);
+    if (!call_cache_helper(restore ? "_pg_pandas_cache_restore" : "_pg_pandas_cache_directory",
+                           args, NULL, 0))
+        ereport(LOG, (errmsg("Error restoring cached frames.")));
+}
+
+/*
+ * Frames owned by the process that last held this worker's slot are passed
+ * on through a file in the pool's directory when it is recycled, so the
+ * next process keeps them fresh from their slots without reloading them.
+ */
+static void
+handover_path(char *path)
+{
+    char dir[MAXPGPATH];
+
+    cache_directory(dir);
+    snprintf(path, MAXPGPATH, "%s/worker%d.handover", dir, MyWorkerIndex);
+}
+
+static void
+release_cached_frames(void)
+{
+    char path[MAXPGPATH];
+
+    handover_path(path);
+    if (!call_cache_helper("_pg_pandas_cache_release", Py_BuildValue("(s)", path), NULL, 0))
+        ereport(LOG, (errmsg("Error handing over cached frames.")));
+}
+
+static void
+adopt_cached_frames(void)
+{
+    char path[MAXPGPATH];
+
+    handover_path(path);
+    if (!call_cache_helper("_pg_pandas_cache_adopt", Py_BuildValue("(s)", path), NULL, 0))
+        ereport(LOG, (errmsg("Error adopting cached frames.")));
+}
+
+/* Read an integer GUC; the GUCs themselves are defined by pg_pandas */
+static int
+worker_guc_int(const char *name)
+{
+    const char *value = GetConfigOption(name, true, false);
+
+    return value ? atoi(value) : 0;
+}
+
+/* Name of the database of a pool in pg_pandas.databases, NULL if unbound */
+static char *
+pool_database(int pool)
+{
+    const char *value = GetConfigOption("pg_pandas.databases", true, false);
+    List *databases;
+
+    if (value == NULL || !SplitIdentifierString(pstrdup(value), ',', &databases) ||
+        pool >= list_length(databases))
+        return NULL;
+    return (char *) list_nth(databases, pool);
+}
+
+/*
+ * Input placed in a huge page memfd by its backend (see
+ * pg_pandas.huge_page_threshold), as a Python string
+ */
+static PyObject *
+read_huge_payload(const PandasPayload *payload)
+{
+#ifdef __linux__
+    char path[MAXPGPATH];
+    struct stat st;
+    PyObject *pData;
+    char *addr;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd/%d", payload->pid, payload->fd);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        (addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    close(fd);
 
-/* Pointer to shared memory */
-static PandasSharedData *pandas_shared = NULL;
+    pData = PyUnicode_FromStringAndSize(addr, payload->len);
+    munmap(addr, st.st_size);
+    return pData;
+#else
+    PyErr_SetString(PyExc_OSError, "huge page payloads are only supported on Linux");
+    return NULL;
+#endif
+}
 
-/* Function declarations */
-void _PG_init(void);
-void pg_pandas_worker_main(Datum main_arg);
-static void process_pandas_operation(void);
+/* Python code applying an operation to the input data */
+static const char *pycode =
+    "import io\n"
+    "import os\n"
+    "import pandas as pd\n"
+    "import json\n"
+    "import sys\n"
+    "if _pg_pandas_data is None:\n"
+    "    df = pd.read_json(_pg_pandas_data_path)\n"
+    "else:\n"
+    "    df = pd.read_json(io.StringIO(_pg_pandas_data))\n"
+    "_pg_pandas_data = None\n"
+    "user_operation = _pg_pandas_operation(_pg_pandas_source)\n"
+    "result = user_operation(df)\n"
+    "result_json = result.to_json(orient='records')\n";
 
-/* List of allowed Python modules */
-const char *allowed_modules[] = {"pandas", "numpy", "json", NULL};
+/* Execute one pandas operation; the result or error text goes to task->result */
+static bool
+process_pandas_operation(PandasTask *task)
+{
+    char error[1024];
+    dsm_segment *seg;
+    const char *data;
 
-/* Signal handler for shutdown */
+    /* Execute Python code */
+    PyObject *pModule = PyImport_AddModule("__main__");
+    PyObject *pDict = PyModule_GetDict(pModule);
+    PyObject *pSource;
+    PyObject *pData;
+    PyObject *pResult;
+
+    /* The operation is compiled once and reused, see _pg_pandas_operation */
+    pSource = PyUnicode_FromStringAndSize(payload_data(pandas_shared, &task->operation, &seg),
+                                          task->operation.len);
+    if (seg != NULL)
+        dsm_detach(seg);
+    PyDict_SetItemString(pDict, "_pg_pandas_source", pSource);
+    Py_XDECREF(pSource);
+
+    if (task->data.kind == PANDAS_PAYLOAD_MEMFD)
+        pData = read_huge_payload(&task->data);
+    else if (task->data.kind == PANDAS_PAYLOAD_FILE)
+    {
+        /* A spilled input is parsed straight from its file */
+        char path[MAXPGPATH];
+        PyObject *pPath;
+
+        payload_file_path(&task->data, path);
+        pPath = PyUnicode_FromString(path);
+        PyDict_SetItemString(pDict, "_pg_pandas_data_path", pPath);
+        Py_XDECREF(pPath);
+        pData = Py_None;
+        Py_INCREF(pData);
+    }
+    else
+    {
+        data = payload_data(pandas_shared, &task->data, &seg);
+        pData = PyUnicode_FromStringAndSize(data, task->data.len);
+        if (seg != NULL)
+            dsm_detach(seg);
+    }
+    if (pData == NULL)
+    {
+        report_python_error(error, sizeof(error));
+        set_task_result(task, error, strlen(error));
+        return false;
+    }
+    PyDict_SetItemString(pDict, "_pg_pandas_data", pData);
+    Py_XDECREF(pData);
+
+    /* Execute prepared Python code */
+    pResult = PyRun_String(pycode, Py_file_input, pDict, pDict);
+    if (pResult == NULL)
+    {
+        report_python_error(error, sizeof(error));
+        ereport(LOG, (errmsg("Error executing Python code.")));
+        set_task_result(task, error, strlen(error));
+        return false;
+    }
+    Py_DECREF(pResult);
+
+    /* Retrieve result */
+    PyObject *pValue = PyDict_GetItemString(pDict, "result_json");
+    Py_ssize_t result_len = 0;
+    const char *result_str = pValue != NULL ? PyUnicode_AsUTF8AndSize(pValue, &result_len) : NULL;
+    if (result_str == NULL)
+    {
+        PyErr_Clear();
+        ereport(LOG, (errmsg("Error retrieving Python code output.")));
+        strlcpy(error, "Error retrieving Python code output.", sizeof(error));
+        set_task_result(task, error, strlen(error));
+        return false;
+    }
+
+    /* Copy the result to shared memory */
+    if (!set_task_result(task, result_str, result_len))
+        return false;
+
+    if (MyWorkerIndex >= 0)
+    {
+        PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+
+        advertise(worker->operations, &worker->next_operation,
+                  PANDAS_ADVERTISED_OPERATIONS, task->operation_hash);
+    }
+    return true;
+}
+
+/*
+ * Run an execute task in the calling backend rather than a worker (see
+ * pg_pandas.inline_threshold).  The first call sets up an interpreter in
+ * the backend the same way a worker does.
+ */
+bool
+pg_pandas_inline_execute(PandasTask *task)
+{
+    static bool initialized = false;
+
+    if (!initialized)
+    {
+        bool found;
+
+        LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+        pandas_shared = ShmemInitStruct("pg_pandas_shared",
+                                        PANDAS_SHMEM_SIZE(worker_guc_int("pg_pandas.payload_memory")),
+                                        &found);
+        LWLockRelease(AddinShmemInitLock);
+
+        /* See the frames of this database's pool, if it has one */
+        LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+        for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+        {
+            if (pandas_shared->workers[i].database == MyDatabaseId)
+                frames_database = MyDatabaseId;
+        }
+        LWLockRelease(&pandas_shared->lock);
+
+        initialize_secure_python();
+
+        /* Python claims SIGINT during initialization; query cancel needs it back */
+        pqsignal(SIGINT, handle_inline_cancel);
+        operation_timeout_id = RegisterTimeout(USER_TIMEOUT, handle_operation_timeout);
+        initialized = true;
+    }
+
+    bool ok;
+    TimestampTz stop_at = task_stop_time(task);
+
+    operation_timed_out = false;
+    if (stop_at != 0)
+        enable_timeout_at(operation_timeout_id, stop_at);
+    current_task = task;
+    PG_TRY();
+    {
+        ok = process_pandas_operation(task);
+    }
+    PG_FINALLY();
+    {
+        current_task = NULL;
+        if (stop_at != 0)
+            disable_timeout(operation_timeout_id, false);
+    }
+    PG_END_TRY();
+
+    /* Drop an interrupt that arrived after the Python code returned */
+    if (PyErr_CheckSignals() < 0)
+        PyErr_Clear();
+
+    if (operation_timed_out && !ok)
+    {
+        const char *message = "operation ran past its pg_pandas.operation_timeout";
+
+        set_task_result(task, message, strlen(message));
+        task->timed_out = true;
+    }
+    return ok;
+}
+
+/*
+ * Whether a should run before b: cancelled tasks are cleared out first,
+ * then higher priority wins.  Within a priority level the tenant with the
+ * least service goes first, then the earlier deadline and arrival.
+ */
+static bool
+runs_before(PandasTask *a, PandasTask *b)
+{
+    if (a->cancelled != b->cancelled)
+        return a->cancelled;
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    if (a->tenant != b->tenant)
+    {
+        uint64 a_service = pandas_shared->tenants[a->tenant].service;
+        uint64 b_service = pandas_shared->tenants[b->tenant].service;
+
+        if (a_service != b_service)
+            return a_service < b_service;
+    }
+    if (a->deadline != b->deadline)
+    {
+        if (a->deadline == 0)
+            return false;
+        if (b->deadline == 0)
+            return true;
+        return a->deadline < b->deadline;
+    }
+    return a->sequence < b->sequence;
+}
+
+/*
+ * Whether starting task stays within the pg_pandas.max_running_per_database
+ * and pg_pandas.max_running_per_role its session had at submit time; lock
+ * held
+ */
+static bool
+within_caps(PandasTask *task)
+{
+    PandasTenant *tenant = &pandas_shared->tenants[task->tenant];
+    int max_database = task->max_running_database;
+    int max_role = task->max_running_role;
+    int database_running = 0;
+    int role_running = 0;
+
+    if (max_database <= 0 && max_role <= 0)
+        return true;
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        int running = pandas_shared->workers[i].running;
+        PandasTenant *other;
+
+        if (running < 0)
+            continue;
+        other = &pandas_shared->tenants[pandas_shared->tasks[running].tenant];
+        if (other->database == tenant->database)
+            database_running++;
+        if (other->role == tenant->role)
+            role_running++;
+    }
+
+    return (max_database <= 0 || database_running < max_database) &&
+           (max_role <= 0 || role_running < max_role);
+}
+
+/*
+ * Position of the task a queue should run next, or -1 if it is empty or
+ * every queued task is held back by a concurrency cap; lock held
+ */
+static int
+pick_task(PandasTaskQueue *queue)
+{
+    int best = -1;
+
+    for (int pos = queue->front; pos != queue->rear; pos++)
+    {
+        PandasTask *candidate = &pandas_shared->tasks[queue->tasks[pos % MAX_TASKS]];
+
+        /* Stolen tasks must belong to this worker's database */
+        if (OidIsValid(frames_database) && candidate->database != frames_database)
+            continue;
+        if (!candidate->cancelled && !within_caps(candidate))
+            continue;
+        if (best < 0 ||
+            runs_before(candidate, &pandas_shared->tasks[queue->tasks[best % MAX_TASKS]]))
+            best = pos;
+    }
+
+    return best;
+}
+
+/*
+ * Busy worker with the longest queue that has a task this worker could
+ * start, or NULL; lock held.  Idle workers only steal from workers that are
+ * running something, so affinity still wins whenever the preferred worker
+ * is free to take its own task.
+ */
+static PandasWorkerState *
+steal_victim(void)
+{
+    PandasWorkerState *victim = NULL;
+    int victim_length = 0;
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        PandasWorkerState *other = &pandas_shared->workers[i];
+        int length = other->queue.rear - other->queue.front;
+
+        if (i == MyWorkerIndex || other->running < 0 || length <= victim_length)
+            continue;
+        if (pick_task(&other->queue) < 0)
+            continue;
+        victim = other;
+        victim_length = length;
+    }
+
+    return victim;
+}
+
+/*
+ * Take the next task from this worker's queue or, when it has nothing to
+ * run, steal one from a busy worker.  Returns NULL if there is no task this
+ * worker may start.
+ */
+static PandasTask *
+dequeue_task(void)
+{
+    PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+    PandasTask *task = NULL;
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    while (task == NULL)
+    {
+        PandasTaskQueue *queue = &worker->queue;
+        int best = pick_task(queue);
+
+        if (best < 0)
+        {
+            PandasWorkerState *victim;
+
+            /* A draining worker only empties its own queue */
+            if (worker->draining)
+                break;
+            victim = steal_victim();
+
+            if (victim == NULL)
+                break;
+            queue = &victim->queue;
+            best = pick_task(queue);
+        }
+
+        /* Fill the hole with the entry at the front */
+        int task_index = queue->tasks[best % MAX_TASKS];
+        queue->tasks[best % MAX_TASKS] = queue->tasks[queue->front % MAX_TASKS];
+        queue->front++;
+
+        PandasTenant *tenant = &pandas_shared->tenants[pandas_shared->tasks[task_index].tenant];
+        tenant->queued--;
+
+        if (pandas_shared->tasks[task_index].cancelled)
+        {
+            /* Nobody is waiting any more */
+            free_task(pandas_shared, &pandas_shared->tasks[task_index]);
+            continue;
+        }
+        task = &pandas_shared->tasks[task_index];
+        task->state = PANDAS_TASK_RUNNING;
+        worker->running = task_index;
+
+        /*
+         * Charge the tenant its expected cost now, so concurrent workers do
+         * not all pick it before the first task finishes.
+         */
+        tenant->running++;
+        pandas_shared->virtual_time = Max(pandas_shared->virtual_time, tenant->service);
+        task->charged = tenant->estimate;
+        tenant->service += task->charged;
+        task->started = GetCurrentTimestamp();
+    }
+    LWLockRelease(&pandas_shared->lock);
+
+    return task;
+}
+
+/* Wake the owner of a task and every backend sharing its result; lock held */
 static void
-handle_shutdown(SIGNAL_ARGS)
+wake_task_waiters(PandasTask *task)
 {
-    int save_errno = errno;
-    if (pandas_shared != NULL)
+    if (task->owner != NULL)
+        SetLatch(&task->owner->procLatch);
+    for (int i = 0; i < task->nwaiters; i++)
+        SetLatch(&task->waiters[i]->procLatch);
+}
+
+/*
+ * Publish a task's outcome and wake the backends waiting for it.  Workers
+ * with queued tasks are woken too, in case those were waiting for this one
+ * to drop below a concurrency cap.
+ */
+static void
+finish_task(PandasTask *task, bool ok)
+{
+    PandasTenant *tenant = &pandas_shared->tenants[task->tenant];
+    uint64 cost = Max(GetCurrentTimestamp() - task->started, 0);
+    struct Latch *waiting[PANDAS_MAX_WORKERS];
+    int nwaiting = 0;
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    pandas_shared->workers[MyWorkerIndex].running = -1;
+
+    cost = cost * PANDAS_DEFAULT_WEIGHT / Max(tenant->weight, 1);
+    tenant->service = tenant->service - task->charged + cost;
+    tenant->estimate = cost;
+    tenant->running--;
+
+    for (int i = 0; i < PANDAS_MAX_WORKERS; i++)
+    {
+        PandasWorkerState *other = &pandas_shared->workers[i];
+
+        if (i != MyWorkerIndex && other->latch != NULL && other->queue.front != other->queue.rear)
+            waiting[nwaiting++] = other->latch;
+    }
+
+    if (task->cancelled)
+        free_task(pandas_shared, task);
+    else
+    {
+        task->state = ok ? PANDAS_TASK_DONE : PANDAS_TASK_FAILED;
+        wake_task_waiters(task);
+    }
+    LWLockRelease(&pandas_shared->lock);
+
+    for (int i = 0; i < nwaiting; i++)
+        SetLatch(waiting[i]);
+}
+
+/*
+ * Fail a task left behind by an exiting worker, or free it if its caller
+ * is gone; caller holds the lock
+ */
+static void
+fail_detached_task(PandasTask *task)
+{
+    if (task->cancelled)
+    {
+        free_task(pandas_shared, task);
+        return;
+    }
+    set_task_result(task, "pg_pandas worker exited", strlen("pg_pandas worker exited"));
+    task->state = PANDAS_TASK_FAILED;
+    wake_task_waiters(task);
+}
+
+/*
+ * Fail whatever is still assigned to this worker when it exits.  Nothing
+ * is left to fail once the slot has been handed to a successor.
+ */
+static void
+worker_detach(int code, Datum arg)
+{
+    PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    if (worker->successor == MyProcPid)
+    {
+        worker->successor = 0;
+        worker->successor_latch = NULL;
+    }
+    if (worker->pid != MyProcPid)
     {
-        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
-        pandas_shared->terminate = true;
         LWLockRelease(&pandas_shared->lock);
+        return;
     }
-    errno = save_errno;
+    worker->latch = NULL;
+    worker->pid = 0;
+    worker->draining = false;
+    memset(worker->operations, 0, sizeof(worker->operations));
+    memset(worker->frames, 0, sizeof(worker->frames));
+    if (worker->running >= 0)
+    {
+        PandasTask *task = &pandas_shared->tasks[worker->running];
+
+        pandas_shared->tenants[task->tenant].running--;
+        fail_detached_task(task);
+    }
+    worker->running = -1;
+    while (worker->queue.front != worker->queue.rear)
+    {
+        PandasTask *task = &pandas_shared->tasks[worker->queue.tasks[worker->queue.front % MAX_TASKS]];
+
+        worker->queue.front++;
+        pandas_shared->tenants[task->tenant].queued--;
+        fail_detached_task(task);
+    }
+    LWLockRelease(&pandas_shared->lock);
 }
 
-/* Initialize secure Python environment */
-static void initialize_secure_python(void) {
-    Py_Initialize();
+/*
+ * Give the memory of a large task back to the operating system (see
+ * pg_pandas.trim_threshold).  The frames of the last operation are still
+ * bound in __main__, so they are dropped first.  pymalloc returns its empty
+ * arenas by itself; the column buffers of pandas and numpy come from malloc,
+ * whose heaps keep freed pages until they are trimmed.
+ */
+static void
+trim_worker_memory(void)
+{
+    static const char *const names[] = {"df", "result", "result_json", "_pg_pandas_data", NULL};
+    PyObject *pDict = PyModule_GetDict(PyImport_AddModule("__main__"));
 
-    /* Import only allowed modules */
-    for (int i = 0; allowed_modules[i] != NULL; i++) {
-        PyRun_SimpleString("import sys");
-        char import_command[256];
-        snprintf(import_command, sizeof(import_command), "import %s", allowed_modules[i]);
-        PyRun_SimpleString(import_command);
+    for (int i = 0; names[i] != NULL; i++)
+    {
+        if (PyDict_DelItemString(pDict, names[i]) < 0)
+            PyErr_Clear();
     }
+    PyGC_Collect();
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+}
 
-    /* Restrict built-in functions */
-    PyRun_SimpleString(
-        "import builtins\n"
-        "allowed_builtins = {'print': print, 'len': len, 'range': range}\n"
-        "builtins.__dict__.clear()\n"
-        "builtins.__dict__.update(allowed_builtins)\n"
-    );
+/*
+ * Resident memory of this process in kilobytes, not counting the shared
+ * memory it has mapped; 0 where it cannot be read
+ */
+static long
+private_memory_kb(void)
+{
+    long kb = 0;
+#ifdef __linux__
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long size;
+    unsigned long resident;
+    unsigned long shared;
+
+    if (statm != NULL && fscanf(statm, "%lu %lu %lu", &size, &resident, &shared) == 3 &&
+        resident > shared)
+        kb = (long) (resident - shared) * (sysconf(_SC_PAGESIZE) / 1024);
+    if (statm != NULL)
+        fclose(statm);
+#endif
+    return kb;
 }
 
-/* Register background worker on extension load */
-void
-_PG_init(void)
+/* Whether this worker has reached pg_pandas.max_requests_per_worker or max_worker_rss */
+static bool
+worker_worn_out(int tasks_run)
+{
+    int max_requests = worker_guc_int("pg_pandas.max_requests_per_worker");
+    int max_rss = worker_guc_int("pg_pandas.max_worker_rss");
+
+    if (max_requests > 0 && tasks_run >= max_requests)
+        return true;
+    return max_rss > 0 && private_memory_kb() > (long) max_rss * 1024;
+}
+
+/*
+ * Start a new process for this worker's slot, registered like this one.
+ * It takes over once its interpreter is up (see hand_over), so calls keep
+ * being served while it starts.  Returns NULL if no background worker
+ * slot is free.
+ */
+static BackgroundWorkerHandle *
+start_replacement(void)
 {
     BackgroundWorker worker;
-    memset(&worker, 0, sizeof(BackgroundWorker));
-    worker.bgw_name = "pg_pandas_worker";
-    worker.bgw_type = "pg_pandas_worker";
-    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
-    worker.bgw_main = pg_pandas_worker_main;
-    worker.bgw_shutdown = handle_shutdown;
-    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    BackgroundWorkerHandle *handle;
+
+    memcpy(&worker, MyBgworkerEntry, sizeof(BackgroundWorker));
+    worker.bgw_restart_time = PANDAS_WORKER_RESTART_TIME;
+    worker.bgw_notify_pid = 0;
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+        return NULL;
+    return handle;
+}
+
+/*
+ * Give this worker's slot to a successor waiting for it.  Called between
+ * tasks; the successor inherits the queue, so no queued call is lost, and
+ * the frames this worker owns.  Returns false if there is no successor.
+ */
+static bool
+hand_over(void)
+{
+    PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+    struct Latch *latch;
+    int pid;
+
+    LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+    latch = worker->successor_latch;
+    LWLockRelease(&pandas_shared->lock);
+    if (latch == NULL)
+        return false;
+
+    release_cached_frames();
+
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    pid = worker->successor;
+    latch = worker->successor_latch;
+    if (latch == NULL)
+    {
+        /* The successor exited meanwhile; keep the slot and the frames */
+        LWLockRelease(&pandas_shared->lock);
+        adopt_cached_frames();
+        return false;
+    }
+    worker->pid = pid;
+    worker->latch = latch;
+    worker->successor = 0;
+    worker->successor_latch = NULL;
+    worker->draining = false;
+    memset(worker->operations, 0, sizeof(worker->operations));
+    memset(worker->frames, 0, sizeof(worker->frames));
+    LWLockRelease(&pandas_shared->lock);
+
+    SetLatch(latch);
+    ereport(LOG, (errmsg("pg_pandas worker %d handed its slot to process %d", MyWorkerIndex, pid)));
+    return true;
+}
+
+/*
+ * Wait until the process in this worker's slot hands it over (see
+ * hand_over).  Returns false on shutdown.
+ */
+static bool
+wait_for_slot(void)
+{
+    PandasWorkerState *worker = &pandas_shared->workers[MyWorkerIndex];
+
+    while (!got_sigterm)
+    {
+        struct Latch *latch = NULL;
+        int pid;
 
-    RegisterBackgroundWorker(&worker);
+        /* Offer to take over, unless another process already waits to */
+        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        pid = worker->pid;
+        if (pid != MyProcPid && worker->successor == 0)
+        {
+            worker->successor = MyProcPid;
+            worker->successor_latch = MyLatch;
+            latch = worker->latch;
+        }
+        LWLockRelease(&pandas_shared->lock);
+        if (latch != NULL)
+            SetLatch(latch);
+
+        /* A predecessor that exited without handing over leaves the slot empty */
+        if (pid == MyProcPid || pid == 0)
+            return true;
+
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         1000L, PG_WAIT_EXTENSION);
+        ResetLatch(MyLatch);
+    }
+    return false;
 }
 
 /* Background worker main function */
@@ -100,114 +2314,225 @@ pg_pandas_worker_main(Datum main_arg)
 {
     /* Establish connection to shared memory */
     bool found;
-    pandas_shared = ShmemInitStruct("pg_pandas_shared", sizeof(PandasSharedData), &found);
+    bool replacing;
+    int parallel;
+    char *database_name;
+    PandasWorkerState *worker;
+
+    MyWorkerIndex = DatumGetInt32(main_arg);
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    pandas_shared = ShmemInitStruct("pg_pandas_shared",
+                                        PANDAS_SHMEM_SIZE(worker_guc_int("pg_pandas.payload_memory")),
+                                        &found);
+    LWLockRelease(AddinShmemInitLock);
     if (!found)
     {
-        /* First time initialization */
-        memset(pandas_shared, 0, sizeof(PandasSharedData));
-        LWLockInitialize(&pandas_shared->lock, LWLockNewTrancheId());
-        pandas_shared->terminate = false;
+        elog(ERROR, "pg_pandas must be loaded via shared_preload_libraries");
     }
+    worker = &pandas_shared->workers[MyWorkerIndex];
+
+    /* A process still in this slot means this one was started to replace it */
+    LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+    replacing = worker->pid != 0;
+    LWLockRelease(&pandas_shared->lock);
 
-    /* Set up signal handler for graceful shutdown */
+    /* Set up signal handlers for graceful shutdown and configuration reloads */
     pqsignal(SIGTERM, handle_shutdown);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
     BackgroundWorkerUnblockSignals();
 
+    pin_worker();
+
+    /*
+     * Workers of a pool listed in pg_pandas.databases connect to its
+     * database, which scopes their cached frames to it, and load and refresh
+     * those frames through SPI.  The others connect to no database at all,
+     * which still lists them in pg_stat_activity, and use libpq.
+     */
+    parallel = Max(worker_guc_int("pg_pandas.parallel"), 1);
+    database_name = pool_database(MyWorkerIndex / parallel);
+    if (database_name != NULL)
+    {
+        BackgroundWorkerInitializeConnection(database_name, NULL, 0);
+        frames_database = MyDatabaseId;
+    }
+    else
+        BackgroundWorkerInitializeConnection(NULL, NULL, 0);
+
+    /* Pick the allocator before Python starts */
+    set_python_allocator();
+
     /* Initialize Python */
     initialize_secure_python();
 
+    /* Installed after Python, which claims SIGINT during initialization */
+    pqsignal(SIGINT, handle_cancel);
+    operation_timeout_id = RegisterTimeout(USER_TIMEOUT, handle_operation_timeout);
+
+    /* Persisted frames are restored once per pool, by its first worker */
+    restore_cached_frames(MyWorkerIndex % parallel == 0 && !replacing);
+    on_shmem_exit(worker_detach, (Datum) 0);
+
+    /* A replacement is ready now, and takes over between two tasks */
+    if (replacing && !wait_for_slot())
+    {
+        Py_Finalize();
+        return;
+    }
+    adopt_cached_frames();
+
+    /* Advertise this worker to the dispatcher */
+    LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+    worker->database = frames_database;
+    worker->pid = MyProcPid;
+    worker->latch = MyLatch;
+    worker->running = -1;
+    worker->draining = false;
+    if (worker->successor == MyProcPid)
+    {
+        worker->successor = 0;
+        worker->successor_latch = NULL;
+    }
+    LWLockRelease(&pandas_shared->lock);
+
+    TimestampTz last_refresh = GetCurrentTimestamp();
+    TimestampTz last_persist = last_refresh;
+    int tasks_run = 0;
+    BackgroundWorkerHandle *replacement = NULL;
+    bool draining = false;
+
     /* Main loop */
-    while (true)
+    while (!got_sigterm)
     {
-        /* Sleep to prevent busy waiting */
-        pg_usleep(10000); /* Sleep for 10ms */
+        /* The intervals and recycling limits below follow reloads */
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
 
-        /* Check for termination signal */
-        if (pandas_shared->terminate)
+        /* Leave once a successor has the slot, or a draining queue is empty */
+        if (hand_over())
             break;
+        if (draining)
+        {
+            bool empty;
 
-        /* Check if there is a new task */
-        LWLockAcquire(&pandas_shared->lock, LW_SHARED);
-        bool ready = pandas_shared->ready;
-        LWLockRelease(&pandas_shared->lock);
+            LWLockAcquire(&pandas_shared->lock, LW_SHARED);
+            empty = worker->queue.front == worker->queue.rear;
+            LWLockRelease(&pandas_shared->lock);
+            if (empty)
+                break;
+        }
 
-        if (!ready)
-            continue;
+        /*
+         * A worn-out worker is replaced by a new process, or drains and is
+         * restarted if none can be started or the new one failed.
+         */
+        bool drain = false;
 
-        /* Acquire exclusive lock to process */
-        LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+        if (!draining && replacement == NULL && tasks_run > 0 && worker_worn_out(tasks_run))
+        {
+            replacement = start_replacement();
+            drain = replacement == NULL;
+        }
+        else if (replacement != NULL)
+        {
+            pid_t pid;
 
-        /* Retrieve data and operation */
-        char *data = pandas_shared->data;
-        char *operation = pandas_shared->operation;
-
-        /* Reset ready flag */
-        pandas_shared->ready = false;
-
-        /* Prepare Python code */
-        char pycode[10000];
-        snprintf(pycode, sizeof(pycode),
-                 "import os\n"
-                 "import pandas as pd\n"
-                 "import psycopg2\n"
-                 "import json\n"
-                 "import sys\n"
-                 "dbhost = os.environ.get('PGHOST', 'localhost')\n"
-                 "dbport = os.environ.get('PGPORT', '5432')\n"
-                 "dbuser = os.environ.get('PGUSER', 'postgres')\n"
-                 "dbpass = os.environ.get('PGPASSWORD', '')\n"
-                 "dbname = os.environ.get('PGDATABASE', 'postgres')\n"
-                 "conn = psycopg2.connect(dbname=dbname, user=dbuser, password=dbpass, host=dbhost, port=dbport)\n"
-                 "df = pd.read_json('%s')\n"
-                 "user_operation = %s\n"
-                 "result = user_operation(df)\n"
-                 "result_json = result.to_json(orient='records')\n"
-                 "print(result_json)\n",
-                 data, operation);
-
-        /* Execute Python code */
-        PyObject *pModule = PyImport_AddModule("__main__");
-        PyObject *pDict = PyModule_GetDict(pModule);
-        PyObject *pResult;
-
-        /* Execute prepared Python code */
-        pResult = PyRun_String(pycode, Py_file_input, pDict, pDict);
-        if (pResult == NULL)
-        {
-            PyErr_Print();
-            ereport(LOG, (errmsg("Error executing Python code.")));
-            /* Handle error: reset ready flag */
-            pandas_shared->ready = true;
+            drain = GetBackgroundWorkerPid(replacement, &pid) == BGWH_STOPPED;
+        }
+        if (drain)
+        {
+            replacement = NULL;
+            draining = true;
+            LWLockAcquire(&pandas_shared->lock, LW_EXCLUSIVE);
+            worker->draining = true;
             LWLockRelease(&pandas_shared->lock);
-            continue;
+            ereport(LOG, (errmsg("pg_pandas worker %d could not be replaced, restarting it once its queue is empty",
+                                 MyWorkerIndex)));
         }
 
-        /* Retrieve result */
-        PyObject *pValue = PyObject_CallMethod(pModule, "print", "O", Py_None);
-        if (pValue == NULL)
+        /* Keep slot-backed cached frames fresh */
+        int refresh_interval = worker_guc_int("pg_pandas.cache_refresh_interval");
+        if (refresh_interval > 0 &&
+            TimestampDifferenceExceeds(last_refresh, GetCurrentTimestamp(), refresh_interval))
         {
-            PyErr_Print();
-            ereport(LOG, (errmsg("Error retrieving Python code output.")));
+            refresh_cached_frames();
+            last_refresh = GetCurrentTimestamp();
         }
+
+        int persist_interval = worker_guc_int("pg_pandas.cache_persist_interval");
+        if (persist_interval > 0 &&
+            TimestampDifferenceExceeds(last_persist, GetCurrentTimestamp(), persist_interval))
+        {
+            persist_cached_frames();
+            last_persist = GetCurrentTimestamp();
+        }
+
+        /* Check if there is a new task */
+        PandasTask *task = dequeue_task();
+        if (task == NULL)
+        {
+            /* Sleep until a backend queues work or a timer is due */
+            (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                             100L, PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+            continue;
+        }
+
+        bool ok;
+        Size task_bytes;
+        TimestampTz stop_at = task_stop_time(task);
+
+        operation_timed_out = false;
+        if (stop_at != 0)
+            enable_timeout_at(operation_timeout_id, stop_at);
+        current_task = task;
+        if (task->command == PANDAS_CMD_EXECUTE)
+            ok = process_pandas_operation(task);
         else
+            ok = process_cache_command(task);
+        current_task = NULL;
+        if (stop_at != 0)
+            disable_timeout(operation_timeout_id, false);
+
+        /* Drop an interrupt that arrived after the Python code returned */
+        if (PyErr_CheckSignals() < 0)
+            PyErr_Clear();
+
+        if (operation_timed_out && !ok)
         {
-            /* Convert result to C string */
-            const char *result_str = PyUnicode_AsUTF8(pValue);
-            if (result_str)
-            {
-                strncpy(pandas_shared->result, result_str, sizeof(pandas_shared->result) - 1);
-                pandas_shared->result[sizeof(pandas_shared->result) - 1] = '\0';
-            }
-            Py_DECREF(pValue);
+            char message[64];
+
+            snprintf(message, sizeof(message), "operation ran past its %s",
+                     stop_at == task->deadline ? "statement_timeout" : "pg_pandas.operation_timeout");
+            set_task_result(task, message, strlen(message));
+            task->timed_out = true;
         }
 
-        Py_DECREF(pResult);
+        /* The owner may free the slot as soon as it is finished */
+        task_bytes = task->data.len + task->result.len;
+        finish_task(task, ok);
+        tasks_run++;
 
-        /* Set ready flag and release lock */
-        pandas_shared->ready = true;
-        LWLockRelease(&pandas_shared->lock);
+        int trim_threshold = worker_guc_int("pg_pandas.trim_threshold");
+        if (trim_threshold > 0 && task_bytes > (Size) trim_threshold * 1024)
+            trim_worker_memory();
     }
 
-    /* Finalize Python */
+    /*
+     * Write cached frames for the next start, or for the process that takes
+     * over a drained worker, then finalize Python
+     */
+    if (draining)
+        release_cached_frames();
+    else
+        persist_cached_frames();
     Py_Finalize();
-}
+
+    /* Exit with an error so the postmaster starts a drained worker again */
+    if (draining)
+        proc_exit(1);
+}
\ No newline at end of file
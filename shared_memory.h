@@ -1,21 +1,258 @@
+/* shared_memory.h
+ *
+ * Shared memory layout used by both the pg_pandas functions and the
+ * pg_pandas background worker.
+ */
+
+#ifndef PG_PANDAS_SHARED_MEMORY_H
+#define PG_PANDAS_SHARED_MEMORY_H
+
+#include "datatype/timestamp.h"
+#include "storage/dsm.h"
+#include "storage/lwlock.h"
+#include "storage/spin.h"
+
+/* Commands handed from a backend to the worker */
+typedef enum {
+    PANDAS_CMD_EXECUTE = 0,     /* apply operation to data */
+    PANDAS_CMD_CACHE_LOAD,      /* (re)load a cached frame, optionally following a slot */
+    PANDAS_CMD_CACHE_DROP       /* forget a cached frame */
+} PandasCommand;
+
+#define PANDAS_MAX_CACHED_FRAMES 64
+
+/*
+ * A cached frame published as an Arrow IPC stream in a pinned DSM segment.
+ * Every worker maps the same segment, so a frame is held once no matter
+ * how many workers read it.  Rows changed since the base copy was
+ * published are kept as a second, smaller stream that readers merge in;
+ * the owner folds it into a new base copy once it grows large.
+ */
+typedef struct {
+    char name[NAMEDATALEN];     /* empty when the entry is free */
+    Oid database;               /* pool that owns it, see PandasWorkerState */
+    dsm_handle handle;          /* base copy */
+    Size size;
+    dsm_handle delta_handle;    /* changed rows, DSM_HANDLE_INVALID if none */
+    Size delta_size;
+    uint64 base_version;        /* version the base copy was published as */
+    uint64 version;             /* changes whenever the base or the delta is republished */
+} PandasCachedFrame;
+
+/* Life cycle of a task slot */
+typedef enum {
+    PANDAS_TASK_FREE = 0,
+    PANDAS_TASK_CLAIMED,        /* being filled by its backend */
+    PANDAS_TASK_QUEUED,         /* waiting in a worker queue */
+    PANDAS_TASK_RUNNING,
+    PANDAS_TASK_DONE,
+    PANDAS_TASK_FAILED          /* result holds the error message */
+} PandasTaskState;
+
+/*
+ * Payloads (input data, operations and results) are variable-sized.  They
+ * are kept in chunks of the payload arena, a buddy allocator placed after
+ * PandasSharedData and sized by pg_pandas.payload_memory.  Chunks are
+ * PANDAS_CHUNK_MIN << order bytes; a payload larger than the largest chunk,
+ * or one that finds the arena full, gets a DSM segment of its own.  Inputs
+ * above pg_pandas.spill_threshold are written to a temporary file instead,
+ * which the worker reads straight from disk, and inputs above
+ * pg_pandas.huge_page_threshold are put in a huge page memfd of the
+ * submitting backend, which the worker maps through /proc.  See payload.h.
+ */
+#define PANDAS_CHUNK_MIN 128
+#define PANDAS_CHUNK_ORDERS 14      /* chunks of up to 1 MB */
+#define PANDAS_CHUNK_MAX ((Size) PANDAS_CHUNK_MIN << (PANDAS_CHUNK_ORDERS - 1))
+
+typedef enum {
+    PANDAS_PAYLOAD_EMPTY = 0,
+    PANDAS_PAYLOAD_ARENA,
+    PANDAS_PAYLOAD_DSM,
+    PANDAS_PAYLOAD_FILE,
+    PANDAS_PAYLOAD_MEMFD
+} PandasPayloadKind;
+
 typedef struct {
-    char data[8192];
-    char operation[2048];
-    char result[65536];
-    bool ready;
-    bool terminate;
-    LWLock lock;
+    PandasPayloadKind kind;
+    Size len;                   /* bytes, not counting the terminating NUL */
+    Size chunk;                 /* offset of the arena chunk */
+    dsm_handle handle;          /* pinned segment outside the arena */
+    Oid tablespace;             /* temporary tablespace of a spill file */
+    uint64 file;                /* number of a spill file */
+    int pid;                    /* backend holding a huge page memfd open */
+    int fd;                     /* its descriptor in that backend */
+} PandasPayload;
+
+/* Backends that can share the result of one task besides its owner */
+#define PANDAS_MAX_WAITERS 32
+
+/* One request from a backend to a worker */
+typedef struct {
+    PandasTaskState state;
+    PandasCommand command;
+    struct PGPROC *owner;       /* backend that submitted it, NULL once it stops waiting */
+    Oid database;               /* database of the owner */
+    bool cancelled;             /* owner gave up; the worker frees the slot */
+    uint32 operation_hash;
+
+    /*
+     * Scheduling: higher priority runs first, then the tenant with the
+     * least service, the earliest deadline (0 if none) and arrival order.
+     */
+    int priority;
+    TimestampTz deadline;
+    uint64 sequence;
+
+    /* Concurrency caps of the submitting session (0 if none) */
+    int max_running_database;
+    int max_running_role;
+
+    /*
+     * Limits on the run time: the statement deadline above and
+     * operation_timeout milliseconds from the start (0 if none).  The
+     * worker sets timed_out when it interrupted the task for exceeding one.
+     */
+    int operation_timeout;
+    bool timed_out;
+
+    /*
+     * Single flight: an execute request identical to one already queued or
+     * running waits for that task instead of running again.  refs counts
+     * the owner and waiters still interested; the last of them frees the
+     * slot, or cancels the task if it has not finished.
+     */
+    uint32 content_hash;
+    int refs;
+    int nwaiters;
+    struct PGPROC *waiters[PANDAS_MAX_WAITERS];
+
+    /* Fair queueing: tenant entry, service charged at start, start time */
+    int tenant;
+    uint64 charged;
+    TimestampTz started;
+
+    /*
+     * Cached frame commands.  For PANDAS_CMD_CACHE_LOAD, data holds the
+     * qualified name of the source relation; slot_name is empty when the
+     * frame is not kept fresh from logical decoding.
+     */
+    char frame_name[NAMEDATALEN];
+    char key_column[NAMEDATALEN];
+    char slot_name[NAMEDATALEN];
+    char publication[NAMEDATALEN];
+    Oid relid;
+
+    /* Freed with the slot; result holds the error message on failure */
+    PandasPayload data;
+    PandasPayload operation;
+    PandasPayload result;
 } PandasTask;
 
+/*
+ * pg_pandas_inline_execute in pg_pandas_worker, which runs an execute task
+ * in the calling backend; see pg_pandas.inline_threshold
+ */
+typedef bool (*PandasInlineExecute) (PandasTask *task);
+
 #define MAX_TASKS 1024
+#define PANDAS_MIN_PRIORITY (-100)
+#define PANDAS_MAX_PRIORITY 100
+#define PANDAS_MAX_WORKERS 16
 
+/* Seconds before a worker that exited with an error is started again */
+#define PANDAS_WORKER_RESTART_TIME 1
+
+/*
+ * Queue of task indexes; front and rear only grow and wrap modulo
+ * MAX_TASKS.  Workers take the entry that should run first, not the oldest.
+ */
 typedef struct {
-    PandasTask tasks[MAX_TASKS];
+    int tasks[MAX_TASKS];
     int front;
     int rear;
-    LWLock lock;
 } PandasTaskQueue;
 
+/*
+ * Fair-queueing state of one (database, role) pair.  service is the worker
+ * time its tasks have used, in microseconds scaled by
+ * PANDAS_DEFAULT_WEIGHT / weight; workers start the queued task whose
+ * tenant has the least service.  An entry is free when it has no queued or
+ * running tasks, so MAX_TASKS entries are always enough.
+ */
+typedef struct {
+    Oid database;
+    Oid role;
+    int weight;
+    int queued;
+    int running;
+    uint64 service;
+    uint64 estimate;            /* scaled cost of its last task, charged up front */
+} PandasTenant;
+
+#define PANDAS_DEFAULT_WEIGHT 100
+
+#define PANDAS_ADVERTISED_OPERATIONS 64
+#define PANDAS_ADVERTISED_FRAMES 16
+
+/*
+ * Per-worker state.  Besides its queue, each worker advertises hashes of
+ * the operations it has compiled and the cached frames it has built views
+ * of, so the dispatcher can send related requests to the same worker.
+ * Workers of a pool listed in pg_pandas.databases are connected to that
+ * database and only take its tasks; database is InvalidOid for the single
+ * pool that serves every database when the list is empty.
+ *
+ * A worker past pg_pandas.max_requests_per_worker or max_worker_rss is
+ * replaced by a new process for the same slot.  The new process starts
+ * Python, then sets successor and waits; the old one hands it the slot,
+ * queue included, between two tasks.  If no replacement can be started,
+ * the old worker is draining instead: it takes no new tasks and exits to
+ * be restarted once its queue is empty.
+ */
 typedef struct {
+    int pid;                    /* 0 when the worker is not running */
+    struct Latch *latch;
+    Oid database;
     PandasTaskQueue queue;
-} PandasSharedData; 
\ No newline at end of file
+    int running;                /* task being processed, or -1 */
+    bool draining;
+    int successor;              /* pid of a replacement ready to take over, or 0 */
+    struct Latch *successor_latch;
+
+    uint32 operations[PANDAS_ADVERTISED_OPERATIONS];
+    int next_operation;
+    uint32 frames[PANDAS_ADVERTISED_FRAMES];
+    int next_frame;
+} PandasWorkerState;
+
+/* Shared memory structure for communication */
+typedef struct {
+    LWLock lock;                /* protects tasks and workers */
+    uint64 next_sequence;
+    PandasTask tasks[MAX_TASKS];
+    PandasWorkerState workers[PANDAS_MAX_WORKERS];
+    uint64 virtual_time;        /* service of the tenant started last */
+    PandasTenant tenants[MAX_TASKS];
+
+    /* Cached frame registry, protected by frames_lock */
+    LWLock frames_lock;
+    uint64 frames_generation;
+    PandasCachedFrame frames[PANDAS_MAX_CACHED_FRAMES];
+
+    /*
+     * Payload arena, protected by arena_lock.  The structure is followed by
+     * one byte per minimum-size chunk, order + 1 at the start of each free
+     * chunk and 0 elsewhere, and then by arena_size bytes of chunks.
+     */
+    slock_t arena_lock;
+    Size arena_size;
+    int64 arena_free[PANDAS_CHUNK_ORDERS];  /* first free chunk of each order, or -1 */
+    uint64 next_spill_file;     /* also protected by arena_lock */
+} PandasSharedData;
+
+/* Shared memory needed for an arena of pg_pandas.payload_memory megabytes */
+#define PANDAS_SHMEM_SIZE(payload_memory) \
+    (MAXALIGN(sizeof(PandasSharedData)) + \
+     ((Size) (payload_memory) << 20) / PANDAS_CHUNK_MIN + ((Size) (payload_memory) << 20))
+
+#endif /* PG_PANDAS_SHARED_MEMORY_H */
@@ -5,6 +5,12 @@ CREATE OR REPLACE FUNCTION test_pandas_basic()
 RETURNS void AS $$
 BEGIN
     PERFORM pandas(ARRAY[1, 2, 3, 4, 5], 'lambda df: df + 10');
+
+    -- Null arguments return no rows, as for a strict function
+    IF EXISTS (SELECT FROM pandas(NULL::text, 'lambda df: df') AS t(r text)) OR
+       EXISTS (SELECT FROM pandas('[{"a": 1}]'::text, NULL) AS t(r text)) THEN
+        RAISE EXCEPTION 'a call with a null argument returned rows';
+    END IF;
 END;
 $$ LANGUAGE plpgsql;
 
@@ -18,6 +24,359 @@ EXCEPTION WHEN others THEN
 END;
 $$ LANGUAGE plpgsql;
 
+-- Test caching a table as a named frame
+CREATE OR REPLACE FUNCTION test_pandas_cache()
+RETURNS void AS $$
+BEGIN
+    CREATE TABLE pandas_cache_source (id int PRIMARY KEY, value text);
+    INSERT INTO pandas_cache_source VALUES (1, 'a'), (2, 'b');
+    PERFORM pandas_cache_table('cache_test', 'pandas_cache_source', 'id');
+    PERFORM pandas_cache_drop('cache_test');
+    DROP TABLE pandas_cache_source;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test an additive pandas materialized view
+CREATE OR REPLACE FUNCTION test_pandas_matview()
+RETURNS void AS $$
+BEGIN
+    CREATE TABLE pandas_matview_source (region text, amount int);
+    INSERT INTO pandas_matview_source VALUES ('east', 1), ('west', 2);
+    PERFORM pandas_create_matview('matview_test', 'pandas_matview_source',
+                                  'lambda df: df.groupby("region")[["amount"]].sum().reset_index()',
+                                  ARRAY['region']);
+    INSERT INTO pandas_matview_source VALUES ('east', 10), ('north', 0);
+    IF pandas_refresh_matview('matview_test') <> 2 THEN
+        RAISE EXCEPTION 'expected two logged changes';
+    END IF;
+    IF (SELECT jsonb_agg(r ORDER BY r ->> 'region') FROM pandas_read_matview('matview_test') r) <>
+       '[{"region": "east", "amount": 11}, {"region": "north", "amount": 0}, {"region": "west", "amount": 2}]' THEN
+        RAISE EXCEPTION 'unexpected view contents after insert';
+    END IF;
+
+    -- A group whose sum is zero stays until its last row is deleted
+    DELETE FROM pandas_matview_source WHERE region = 'west';
+    INSERT INTO pandas_matview_source VALUES ('north', 3);
+    DELETE FROM pandas_matview_source WHERE region = 'north' AND amount = 3;
+    IF pandas_refresh_matview('matview_test') <> 3 THEN
+        RAISE EXCEPTION 'expected three logged changes';
+    END IF;
+    IF (SELECT jsonb_agg(r ORDER BY r ->> 'region') FROM pandas_read_matview('matview_test') r) <>
+       '[{"region": "east", "amount": 11}, {"region": "north", "amount": 0}]' THEN
+        RAISE EXCEPTION 'unexpected view contents after delete';
+    END IF;
+    DELETE FROM pandas_matview_source WHERE region = 'north';
+    PERFORM pandas_refresh_matview('matview_test');
+    IF EXISTS (SELECT 1 FROM pandas_read_matview('matview_test') r WHERE r ->> 'region' = 'north') THEN
+        RAISE EXCEPTION 'group without rows was not removed';
+    END IF;
+
+    -- TRUNCATE rebuilds the view
+    TRUNCATE pandas_matview_source;
+    PERFORM pandas_refresh_matview('matview_test');
+    IF EXISTS (SELECT 1 FROM pandas_read_matview('matview_test')) THEN
+        RAISE EXCEPTION 'view not empty after truncate';
+    END IF;
+    PERFORM pandas_drop_matview('matview_test');
+    DROP TABLE pandas_matview_source;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test the priority argument of pandas() and its range
+CREATE OR REPLACE FUNCTION test_pandas_priority()
+RETURNS void AS $$
+DECLARE
+    data text := '[{"a": 1}, {"a": 2}]';
+    plain jsonb;
+    urgent jsonb;
+BEGIN
+    SELECT r::jsonb INTO plain FROM pandas(data, 'lambda df: df.assign(b=df.a * 2)') AS t(r text);
+    SELECT r::jsonb INTO urgent
+    FROM pandas(data, 'lambda df: df.assign(b=df.a * 2)', priority => 100) AS t(r text);
+    IF plain <> '[{"a": 1, "b": 2}, {"a": 2, "b": 4}]' OR urgent <> plain THEN
+        RAISE EXCEPTION 'unexpected result with a priority: %', urgent;
+    END IF;
+
+    BEGIN
+        PERFORM * FROM pandas(data, 'lambda df: df', priority => 101) AS t(r text);
+        RAISE EXCEPTION 'priority out of range was accepted';
+    EXCEPTION WHEN invalid_parameter_value THEN
+        NULL;
+    END;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test that a session's concurrency cap serializes its tasks without losing any
+CREATE OR REPLACE FUNCTION test_pandas_caps()
+RETURNS void AS $$
+DECLARE
+    data text;
+    total numeric;
+    nrows bigint;
+BEGIN
+    PERFORM set_config('pg_pandas.max_running_per_role', '1', true);
+    SELECT json_agg(json_build_object('k', i % 5, 'v', i))::text INTO data
+    FROM generate_series(1, 100) AS i;
+
+    SELECT count(*), sum((e ->> 'w')::numeric) INTO nrows, total
+    FROM pandas_partitioned(data, 'lambda df: df.assign(w=df.v * 2)', 'k', shards => 4) AS p(r),
+         jsonb_array_elements(p.r::jsonb) AS e;
+    IF nrows <> 100 OR total <> 10100 THEN
+        RAISE EXCEPTION 'capped partitioned call returned % rows summing to %', nrows, total;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test the queue depth and the queue limit (run with pg_pandas.max_queue_depth = 1)
+CREATE OR REPLACE FUNCTION test_pandas_admission()
+RETURNS void AS $$
+DECLARE
+    data text;
+BEGIN
+    IF pandas_queue_depth() <> 0 THEN
+        RAISE EXCEPTION 'queue not empty while idle';
+    END IF;
+
+    -- The first shard keeps the worker busy while the others queue up
+    SELECT json_agg(json_build_object('k', i))::text INTO data FROM generate_series(1, 64) AS i;
+    BEGIN
+        PERFORM * FROM pandas_partitioned(
+            data, 'lambda df: df if len([x for x in range(30000000) if x < 0]) == 0 else df',
+            'k', shards => 16) AS p(r);
+        RAISE EXCEPTION 'queue limit was not enforced';
+    EXCEPTION WHEN insufficient_resources THEN
+        NULL;
+    END;
+
+    IF pandas_queue_depth() <> 0 THEN
+        RAISE EXCEPTION 'abandoned shards were left in the queue';
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test that pg_pandas.operation_timeout interrupts a long operation
+CREATE OR REPLACE FUNCTION test_pandas_operation_timeout()
+RETURNS void AS $$
+DECLARE
+    result jsonb;
+BEGIN
+    PERFORM set_config('pg_pandas.operation_timeout', '100', true);
+    BEGIN
+        PERFORM * FROM pandas('[{"a": 1}]'::text,
+                              'lambda df: df if len([x for x in range(10 ** 12) if x < 0]) == 0 else df')
+                  AS t(r text);
+        RAISE EXCEPTION 'operation_timeout was not enforced';
+    EXCEPTION WHEN query_canceled THEN
+        NULL;
+    END;
+
+    -- The worker is free again
+    SELECT r::jsonb INTO result FROM pandas('[{"a": 1}]'::text, 'lambda df: df') AS t(r text);
+    IF result <> '[{"a": 1}]' THEN
+        RAISE EXCEPTION 'unexpected result after a timeout: %', result;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test that identical calls in flight at the same time share one task.
+-- Both sessions are capped at one running task, so a second task would
+-- wait in the queue; a call that joined the first one queues nothing.
+CREATE OR REPLACE FUNCTION test_pandas_identical()
+RETURNS void AS $$
+DECLARE
+    call text := $q$SELECT r FROM pandas('[{"a": 1}, {"a": 2}]'::text,
+        'lambda df: df.assign(b=df.a + 1) if len([x for x in range(30000000) if x < 0]) == 0 else df')
+        AS t(r text)$q$;
+    depth int;
+    first jsonb;
+    second jsonb;
+BEGIN
+    CREATE EXTENSION IF NOT EXISTS dblink;
+    PERFORM dblink_connect('pandas_first', 'dbname=' || current_database());
+    PERFORM dblink_connect('pandas_second', 'dbname=' || current_database());
+    PERFORM dblink_exec('pandas_first', 'SET pg_pandas.max_running_per_role = 1; SET pg_pandas.inline_threshold = 0');
+    PERFORM dblink_exec('pandas_second', 'SET pg_pandas.max_running_per_role = 1; SET pg_pandas.inline_threshold = 0');
+
+    PERFORM dblink_send_query('pandas_first', call);
+    PERFORM pg_sleep(0.5);
+    PERFORM dblink_send_query('pandas_second', call);
+    PERFORM pg_sleep(0.5);
+    depth := pandas_queue_depth();
+
+    SELECT r::jsonb INTO first FROM dblink_get_result('pandas_first') AS t(r text);
+    SELECT r::jsonb INTO second FROM dblink_get_result('pandas_second') AS t(r text);
+    PERFORM dblink_disconnect('pandas_first');
+    PERFORM dblink_disconnect('pandas_second');
+
+    IF depth <> 0 THEN
+        RAISE EXCEPTION 'the second call queued a task of its own';
+    END IF;
+    IF first <> '[{"a": 1, "b": 2}, {"a": 2, "b": 3}]' OR second <> first THEN
+        RAISE EXCEPTION 'identical calls returned % and %', first, second;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test partitioned operations with and without a reduce step
+CREATE OR REPLACE FUNCTION test_pandas_partitioned()
+RETURNS void AS $$
+DECLARE
+    data text;
+    result jsonb;
+BEGIN
+    SELECT json_agg(json_build_object('k', i % 5, 'v', i))::text INTO data
+    FROM generate_series(1, 100) AS i;
+
+    -- Grouping by the key decomposes by shard
+    SELECT jsonb_agg(e ORDER BY (e ->> 'k')::int) INTO result
+    FROM pandas_partitioned(data, 'lambda df: df.groupby("k")[["v"]].sum().reset_index()',
+                            'k', shards => 3) AS p(r),
+         jsonb_array_elements(p.r::jsonb) AS e;
+    IF result <> '[{"k": 0, "v": 1050}, {"k": 1, "v": 970}, {"k": 2, "v": 990},
+                   {"k": 3, "v": 1010}, {"k": 4, "v": 1030}]' THEN
+        RAISE EXCEPTION 'unexpected grouped result: %', result;
+    END IF;
+
+    -- A global total needs the reduce step
+    SELECT p.r::jsonb INTO result
+    FROM pandas_partitioned(data, 'lambda df: df[["v"]].sum().to_frame().T', 'k', shards => 3,
+                            reduce => 'lambda df: df.sum().to_frame().T') AS p(r);
+    IF result <> '[{"v": 5050}]' THEN
+        RAISE EXCEPTION 'unexpected reduced result: %', result;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test an input passed through a temporary file
+CREATE OR REPLACE FUNCTION test_pandas_spill()
+RETURNS void AS $$
+DECLARE
+    data text;
+    total numeric;
+    nrows bigint;
+BEGIN
+    PERFORM set_config('pg_pandas.spill_threshold', '1', true);
+    SELECT json_agg(json_build_object('v', i, 'label', repeat('x', 20)))::text INTO data
+    FROM generate_series(1, 200) AS i;
+
+    SELECT count(*), sum((e ->> 'w')::numeric) INTO nrows, total
+    FROM pandas(data, 'lambda df: df.assign(w=df.v * 2)') AS t(r text),
+         jsonb_array_elements(t.r::jsonb) AS e;
+    IF nrows <> 200 OR total <> 40200 THEN
+        RAISE EXCEPTION 'spilled input returned % rows summing to %', nrows, total;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test an input passed in huge pages, or in shared memory when there are none
+CREATE OR REPLACE FUNCTION test_pandas_huge_pages()
+RETURNS void AS $$
+DECLARE
+    data text;
+    total numeric;
+    nrows bigint;
+BEGIN
+    PERFORM set_config('pg_pandas.huge_page_threshold', '1', true);
+    SELECT json_agg(json_build_object('v', i, 'label', repeat('x', 20)))::text INTO data
+    FROM generate_series(1, 200) AS i;
+
+    SELECT count(*), sum((e ->> 'w')::numeric) INTO nrows, total
+    FROM pandas(data, 'lambda df: df.assign(w=df.v * 2)') AS t(r text),
+         jsonb_array_elements(t.r::jsonb) AS e;
+    IF nrows <> 200 OR total <> 40200 THEN
+        RAISE EXCEPTION 'huge page input returned % rows summing to %', nrows, total;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test consecutive calls while workers are replaced after every task
+-- (run with pg_pandas.max_requests_per_worker = 1)
+CREATE OR REPLACE FUNCTION test_pandas_recycling()
+RETURNS void AS $$
+DECLARE
+    result jsonb;
+    pids_before int[];
+    pids_after int[];
+BEGIN
+    PERFORM pg_stat_clear_snapshot();
+    SELECT array_agg(pid) INTO pids_before
+    FROM pg_stat_activity WHERE backend_type = 'pg_pandas_worker';
+    IF pids_before IS NULL THEN
+        RAISE EXCEPTION 'no pg_pandas workers in pg_stat_activity';
+    END IF;
+
+    FOR i IN 1..3 LOOP
+        SELECT r::jsonb INTO result
+        FROM pandas(format('[{"a": %s}]', i), 'lambda df: df.assign(b=df.a * 10)') AS t(r text);
+        IF result <> jsonb_build_array(jsonb_build_object('a', i, 'b', i * 10)) THEN
+            RAISE EXCEPTION 'call % returned % after recycling', i, result;
+        END IF;
+    END LOOP;
+
+    -- A worker that ran a task hands its slot to a new process
+    FOR attempt IN 1..100 LOOP
+        PERFORM pg_stat_clear_snapshot();
+        SELECT coalesce(array_agg(pid), '{}') INTO pids_after
+        FROM pg_stat_activity WHERE backend_type = 'pg_pandas_worker';
+        EXIT WHEN NOT pids_before <@ pids_after;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    IF pids_before <@ pids_after THEN
+        RAISE EXCEPTION 'no worker was replaced: pids % before, % after', pids_before, pids_after;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Test batched operations, including a LIMIT that stops reading early
+CREATE OR REPLACE FUNCTION test_pandas_map_batches()
+RETURNS void AS $$
+DECLARE
+    nbatches bigint;
+    total numeric;
+    first jsonb;
+BEGIN
+    SELECT count(DISTINCT b.r), sum((e ->> 'j')::numeric) INTO nbatches, total
+    FROM (SELECT pandas_map_batches('SELECT i FROM generate_series(1, 25) AS i',
+                                    'lambda df: df.assign(j=df.i * 2)', batch_size => 10) AS r) AS b,
+         jsonb_array_elements(b.r::jsonb) AS e;
+    IF nbatches <> 3 OR total <> 650 THEN
+        RAISE EXCEPTION '% batches summing to %, expected 3 and 650', nbatches, total;
+    END IF;
+
+    -- Called in the select list, only the first batch is read (the query
+    -- streams too: generate_series in FROM would be materialized)
+    SELECT r::jsonb INTO first
+    FROM (SELECT pandas_map_batches('SELECT generate_series(1, 100000000) AS i',
+                                    'lambda df: df', batch_size => 10) AS r
+          LIMIT 1) AS b;
+    IF jsonb_array_length(first) <> 10 OR first -> 0 <> '{"i": 1}' THEN
+        RAISE EXCEPTION 'unexpected first batch: %', first;
+    END IF;
+END;
+$$ LANGUAGE plpgsql;
+
 -- Execute tests
 SELECT test_pandas_basic();
-SELECT test_pandas_overflow(); 
\ No newline at end of file
+SELECT test_pandas_overflow();
+SELECT test_pandas_cache();
+SELECT test_pandas_matview();
+SELECT test_pandas_priority();
+SELECT test_pandas_caps();
+ALTER SYSTEM SET pg_pandas.max_queue_depth = 1;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.5);
+SELECT test_pandas_admission();
+ALTER SYSTEM RESET pg_pandas.max_queue_depth;
+SELECT pg_reload_conf();
+SELECT test_pandas_operation_timeout();
+SELECT test_pandas_identical();
+SELECT test_pandas_partitioned();
+SELECT test_pandas_spill();
+SELECT test_pandas_huge_pages();
+ALTER SYSTEM SET pg_pandas.max_requests_per_worker = 1;
+SELECT pg_reload_conf();
+SELECT pg_sleep(0.5);
+SELECT test_pandas_recycling();
+ALTER SYSTEM RESET pg_pandas.max_requests_per_worker;
+SELECT pg_reload_conf();
+SELECT test_pandas_map_batches();